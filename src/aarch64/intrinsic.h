@@ -49,6 +49,23 @@ static ALWAYS_INLINE void arch_fence()
 	arch_isb();
 }
 
+/*
+ * Get the size of the block zeroed by `dc zva` in bytes, or 0 if the
+ * instruction is prohibited.
+ */
+static WARN_RESULT ALWAYS_INLINE u64 arch_get_zva_size()
+{
+	u64 dczid;
+	asm volatile("mrs %[x], dczid_el0" : [x] "=r"(dczid));
+	return (dczid & (1 << 4)) ? 0 : 4ULL << (dczid & 0xF);
+}
+
+/* Zero the block of `arch_get_zva_size()` bytes at `p`, which is aligned. */
+static ALWAYS_INLINE void arch_dc_zva(void *p)
+{
+	asm volatile("dc zva, %[x]" : : [x] "r"(p) : "memory");
+}
+
 /* Data cache clean and invalidate by virtual address to point of coherency. */
 static ALWAYS_INLINE void arch_dccivac(void *p, int n)
 {
@@ -120,12 +137,73 @@ static ALWAYS_INLINE void arch_tlbi_vmalle1is()
 	arch_fence();
 }
 
-/* Set Translation Table Base Register 0 (EL1). */
+/* Flush the TLB entries of this core only. */
+static ALWAYS_INLINE void arch_tlbi_vmalle1()
+{
+	arch_fence();
+	asm volatile("tlbi vmalle1");
+	arch_fence();
+}
+
+/*
+ * Invalidate the TLB entries of the page at `va` on all cores. The caller
+ * issues the barriers around a batch of these, see `arch_tlbi_begin/end`.
+ */
+static ALWAYS_INLINE void arch_tlbi_vaae1is(u64 va)
+{
+	asm volatile("tlbi vaae1is, %[x]" : : [x] "r"(va >> 12) : "memory");
+}
+
+/* Like `arch_tlbi_vaae1is`, but only for the entries tagged with `asid`. */
+static ALWAYS_INLINE void arch_tlbi_vae1is(u64 va, u64 asid)
+{
+	asm volatile("tlbi vae1is, %[x]"
+		     :
+		     : [x] "r"((asid << 48) | ((va >> 12) & 0xfffffffffff))
+		     : "memory");
+}
+
+/* Flush the TLB entries tagged with `asid` on all cores. */
+static ALWAYS_INLINE void arch_tlbi_aside1is(u64 asid)
+{
+	arch_fence();
+	asm volatile("tlbi aside1is, %[x]" : : [x] "r"(asid << 48));
+	arch_fence();
+}
+
+/* Make the page table updates visible to the table walkers before TLBIs. */
+static ALWAYS_INLINE void arch_tlbi_begin()
+{
+	asm volatile("dsb ishst" ::: "memory");
+}
+
+/* Wait for the TLBIs issued so far to complete on all cores. */
+static ALWAYS_INLINE void arch_tlbi_end()
+{
+	asm volatile("dsb ish" ::: "memory");
+	arch_isb();
+}
+
+/*
+ * Set Translation Table Base Register 0 (EL1). Only this core may hold TLB
+ * entries of the old address space, so the flush is not broadcast.
+ */
 static ALWAYS_INLINE void arch_set_ttbr0(u64 addr)
 {
 	arch_fence();
 	asm volatile("msr ttbr0_el1, %[x]" : : [x] "r"(addr));
-	arch_tlbi_vmalle1is();
+	arch_tlbi_vmalle1();
+}
+
+/*
+ * Set TTBR0 (EL1) to `addr` tagged with `asid`. The TLB entries of other ASIDs
+ * stay valid, so nothing is flushed.
+ */
+static ALWAYS_INLINE void arch_set_ttbr0_asid(u64 addr, u64 asid)
+{
+	arch_fence();
+	asm volatile("msr ttbr0_el1, %[x]" : : [x] "r"(addr | (asid << 48)));
+	arch_isb();
 }
 
 static inline WARN_RESULT u64 arch_get_ttbr0()
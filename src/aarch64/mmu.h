@@ -3,6 +3,7 @@
 #include <lib/defines.h>
 
 #define PAGE_SIZE 4096
+#define HUGE_PAGE_SIZE (1 << 21) // Mapped by a level-2 block entry.
 
 /* memory region attributes */
 #define MT_DEVICE_nGnRnE 0x0
@@ -30,10 +31,14 @@
 #define PTE_KERNEL (0 << 6)
 #define PTE_USER (1 << 6)
 #define PTE_RO (1 << 7)
+#define PTE_NG (1 << 11) // Not global: TLB entries are tagged with the ASID.
+#define PTE_DIRTY (1ULL << 55) // Software: the page of a shared mapping is dirty.
+#define PTE_TABLE_RO (1ULL << 62) // APTable: no writes through the next level.
 #define PTE_RW (0 << 7)
 #define PTE_KERNEL_DATA (PTE_KERNEL | PTE_NORMAL | PTE_BLOCK)
 #define PTE_KERNEL_DEVICE (PTE_KERNEL | PTE_DEVICE | PTE_BLOCK)
-#define PTE_USER_DATA (PTE_USER | PTE_NORMAL | PTE_PAGE)
+#define PTE_USER_DATA (PTE_USER | PTE_NORMAL | PTE_PAGE | PTE_NG)
+#define PTE_USER_BLOCK (PTE_USER | PTE_NORMAL | PTE_BLOCK | PTE_NG)
 #define PTE_HIGH_NX (1LL << 54)
 
 #define KSPACE_MASK 0xffff000000000000
@@ -7,9 +7,38 @@
 #include <proc/sched.h>
 #include <vm/pgfault_handler.h>
 
+/*
+ * An entry of the exception table. An unresolved fault at `insn`, which
+ * accesses user memory on behalf of the kernel, resumes at `fixup`. See
+ * aarch64/usercopy.S.
+ */
+struct exception_table_entry {
+	u64 insn;
+	u64 fixup;
+};
+
+extern struct exception_table_entry __start___ex_table[], __stop___ex_table[];
+
+/* Redirect `context` to the fixup of the faulting instruction, if it has one. */
+static bool fixup_exception(UserContext *context)
+{
+	for (struct exception_table_entry *e = __start___ex_table;
+	     e < __stop___ex_table; e++) {
+		if (e->insn == context->elr) {
+			context->elr = e->fixup;
+			return true;
+		}
+	}
+	return false;
+}
+
 void trap_global_handler(UserContext *context)
 {
-	thisproc()->ucontext = context;
+	// Faults on user memory can also be taken from the kernel, which must not
+	// replace the user context of the process.
+	bool from_user = (context->spsr & SPSR_M_MASK) == SPSR_EL0T;
+	if (from_user)
+		thisproc()->ucontext = context;
 
 	u64 esr = arch_get_esr();
 	u64 ec = esr >> ESR_EC_SHIFT;
@@ -29,10 +58,16 @@ void trap_global_handler(UserContext *context)
 		syscall_entry(context);
 	} break;
 	case ESR_EC_IABORT_EL0:
-	case ESR_EC_IABORT_EL1:
-	case ESR_EC_DABORT_EL0:
+	case ESR_EC_DABORT_EL0: {
+		if (pgfault_handler(iss) < 0)
+			thisproc()->killed = true;
+	} break;
 	case ESR_EC_DABORT_EL1: {
-		pgfault_handler(iss);
+		if (pgfault_handler(iss) < 0 && !fixup_exception(context)) {
+			printk("[FDCore] Kernel page fault at %p\n",
+			       (void *)arch_get_far());
+			PANIC();
+		}
 	} break;
 	default: {
 		printk("[FDCore] Unknwon exception %llu\n", ec);
@@ -40,7 +75,7 @@ void trap_global_handler(UserContext *context)
 	}
 	}
 
-	if (thisproc()->killed && thisproc()->ucontext->spsr != 0) {
+	if (thisproc()->killed && from_user) {
 		exit(-1);
 	}
 }
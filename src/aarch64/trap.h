@@ -11,3 +11,6 @@
 #define ESR_EC_IABORT_EL1 0x21
 #define ESR_EC_DABORT_EL0 0x24
 #define ESR_EC_DABORT_EL1 0x25
+#define ISS_WNR (1 << 6) // Data abort caused by a write.
+#define SPSR_M_MASK 0xF
+#define SPSR_EL0T 0x0 // The exception was taken from EL0.
@@ -8,12 +8,14 @@
 
 static struct {
 	u64 one_ms;
+	u64 one_us;
 	ClockHandler handler;
 } clock;
 
 void init_clock()
 {
 	clock.one_ms = get_clock_frequency() / 1000;
+	clock.one_us = get_clock_frequency() / 1000000;
 
 	/* Reserve one second for the first time. */
 	asm volatile("msr cntp_ctl_el0, %[x]" ::[x] "r"(1ll));
@@ -27,6 +29,11 @@ u64 get_timestamp_ms()
 	return get_timestamp() / clock.one_ms;
 }
 
+u64 get_timestamp_us()
+{
+	return get_timestamp() / clock.one_us;
+}
+
 void reset_clock(u64 countdown_ms)
 {
 	u64 t = countdown_ms * clock.one_ms;
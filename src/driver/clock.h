@@ -5,6 +5,7 @@
 typedef void (*ClockHandler)(void);
 
 WARN_RESULT u64 get_timestamp_ms();
+WARN_RESULT u64 get_timestamp_us();
 void init_clock();
 void reset_clock(u64 countdown_ms);
 void set_clock_handler(ClockHandler handler);
@@ -8,6 +8,7 @@
 #include <proc/sched.h>
 
 static InterruptHandler int_handler[NUM_IRQ_TYPES];
+static InterruptHandler ipi_handler[NUM_IPI_TYPES];
 
 define_early_init(interrupt)
 {
@@ -22,10 +23,50 @@ void set_interrupt_handler(InterruptType type, InterruptHandler handler)
 	int_handler[type] = handler;
 }
 
+/* Let mailbox 0 of this core raise an IRQ. Called on each core. */
+void init_ipi()
+{
+	device_put_u32(CORE_MBOX_CTRL(cpuid()), CORE_MBOX_IRQ(0));
+}
+
+void set_ipi_handler(IpiType type, InterruptHandler handler)
+{
+	ipi_handler[type] = handler;
+}
+
+/*
+ * Raise `type` on `cpu`. The mailbox keeps one bit per type, so IPIs of the
+ * same type that are sent before the first one is handled are merged.
+ */
+void send_ipi(int cpu, IpiType type)
+{
+	device_put_u32(CORE_MBOX_SET(cpu, 0), 1u << type);
+}
+
 void interrupt_global_handler()
 {
 	u32 source = device_get_u32(IRQ_SRC_CORE(cpuid()));
 
+	/* Handle inter-processor interrupts */
+	if (source & IRQ_SRC_MBOX(0)) {
+		source ^= IRQ_SRC_MBOX(0);
+
+		/* Clear the pending types before handling them */
+		u32 pending = device_get_u32(CORE_MBOX_RDCLR(cpuid(), 0));
+		device_put_u32(CORE_MBOX_RDCLR(cpuid(), 0), pending);
+
+		for (usize i = 0; i < NUM_IPI_TYPES; i++) {
+			if ((pending >> i) & 1) {
+				if (ipi_handler[i]) {
+					ipi_handler[i]();
+				} else {
+					printk("Unknown IPI type %lld", i);
+					PANIC();
+				}
+			}
+		}
+	}
+
 	/* Handle Non-secure Physical Timer interrupts */
 	if (source & IRQ_SRC_CNTPNSIRQ) {
 		source ^= IRQ_SRC_CNTPNSIRQ;
@@ -10,7 +10,18 @@ typedef enum {
 	IRQ_ARASANSDIO = 62,
 } InterruptType;
 
+/* Inter-processor interrupts, sent through mailbox 0 of the target core. */
+#define NUM_IPI_TYPES 32
+
+typedef enum {
+	IPI_RESCHEDULE = 0,
+	IPI_TIMER = 1,
+} IpiType;
+
 typedef void (*InterruptHandler)();
 
 void interrupt_global_handler();
 void set_interrupt_handler(InterruptType type, InterruptHandler handler);
+void init_ipi();
+void set_ipi_handler(IpiType type, InterruptHandler handler);
+void send_ipi(int cpu, IpiType type);
@@ -20,6 +20,7 @@
 
 #define IRQ_SRC_CORE(i) (LOCAL_BASE + 0x60 + 4 * (i))
 #define IRQ_SRC_TIMER (1 << 11) /* Local Timer */
+#define IRQ_SRC_MBOX(m) (1 << (4 + (m))) /* Core Mailbox */
 #define IRQ_SRC_GPU (1 << 8)
 #define IRQ_SRC_CNTPNSIRQ (1 << 1) /* Core Timer */
 #define FIQ_SRC_CORE(i) (LOCAL_BASE + 0x70 + 4 * (i))
@@ -40,3 +41,9 @@
 /* Core Timer */
 #define CORE_TIMER_CTRL(i) (LOCAL_BASE + 0x40 + 4 * (i))
 #define CORE_TIMER_ENABLE (1 << 1) /* CNTPNSIRQ */
+
+/* Core Mailboxes */
+#define CORE_MBOX_CTRL(i) (LOCAL_BASE + 0x50 + 4 * (i))
+#define CORE_MBOX_IRQ(m) (1 << (m))
+#define CORE_MBOX_SET(i, m) (LOCAL_BASE + 0x80 + 16 * (i) + 4 * (m))
+#define CORE_MBOX_RDCLR(i, m) (LOCAL_BASE + 0xC0 + 16 * (i) + 4 * (m))
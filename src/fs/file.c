@@ -8,6 +8,9 @@
 #include <lib/sem.h>
 #include <lib/spinlock.h>
 #include <lib/string.h>
+#include <proc/sched.h>
+#include <vm/uaccess.h>
+#include <vm/vmregion.h>
 
 /* The global file table. */
 static struct ftable ftable;
@@ -105,6 +108,19 @@ int file_stat(struct file *f, struct stat *st)
 	return -1;
 }
 
+/*
+ * Whether the buffer [addr, addr + n) has to go through a kernel page. A fault
+ * on a file-backed user page takes the lock of its inode and may read from the
+ * disk, which must not happen while an inode is locked and a block held.
+ * Other user pages and kernel buffers are copied directly.
+ */
+static bool need_bounce(char *addr, isize n)
+{
+	return is_user_address(addr) &&
+	       check_vmregion_file_backed(&thisproc()->vmspace, (u64)addr,
+					  (u64)addr + n);
+}
+
 /**
  * Read the content of `f` with range [f->off, f->off + n).
  * 
@@ -119,20 +135,37 @@ isize file_read(struct file *f, char *addr, isize n)
 	if (f->readable == 0)
 		return -1;
 
-	// Handle the read of a pipe.
+	// Handle the read of a pipe. With a single reference to this end, we are
+	// its only reader and can skip the lock of the pipe.
 	if (f->type == FD_PIPE) {
-		r = pipe_read(f->pipe, (u64)addr, n);
+		r = pipe_read(f->pipe, (u64)addr, n, f->ref == 1);
 	}
-	// Handle the read of an inode.
+	// Handle the read of an inode. A fault ends the read early.
 	else if (f->type == FD_INODE) {
-		inodes.lock(f->ip);
-
-		// Read the inode. On a successful read, update the file offset.
-		r = inodes.read(f->ip, (u8 *)addr, f->off, n);
-		if (r > 0)
-			f->off += r;
-
-		inodes.unlock(f->ip);
+		char *buf = NULL;
+		if (need_bounce(addr, n) && !(buf = kalloc_page()))
+			return -1;
+		while (r < n) {
+			isize m = buf ? MIN(n - r, (isize)PAGE_SIZE) : n - r;
+			inodes.lock(f->ip);
+
+			// Read the inode. On a successful read, update the file offset.
+			isize k = inodes.read(f->ip, (u8 *)(buf ? buf : addr + r),
+					      f->off, m);
+			if (k > 0)
+				f->off += k;
+
+			inodes.unlock(f->ip);
+			if (k < 0 || (buf && copy_out(addr + r, buf, k) < 0)) {
+				r = r ? r : -1;
+				break;
+			}
+			r += k;
+			if (k < m)
+				break;
+		}
+		if (buf)
+			kfree_page(buf);
 	}
 	// It is illegal to use file_read to read a directory.
 	// Use opendir, readdir, and closedir to perform directory operations.
@@ -157,21 +190,45 @@ isize file_write(struct file *f, char *addr, isize n)
 	if (!f->writable)
 		return -1;
 
-	// Handle the write to a pipe.
+	// Handle the write to a pipe. Like reads, writes through a single reference
+	// skip the lock of the pipe.
 	if (f->type == FD_PIPE) {
-		r = (isize)pipe_write(f->pipe, (u64)addr, n);
+		r = (isize)pipe_write(f->pipe, (u64)addr, n, f->ref == 1);
 	}
-	// Handle the write to an inode.
+	// Handle the write to an inode, a page at a time to keep each transaction
+	// within the size of the log. A fault ends the write early.
 	else if (f->type == FD_INODE) {
-		OpContext ctx;
-		bcache.begin_op(&ctx);
-		inodes.lock(f->ip);
-		// Write the inode. On a successful write, update the file offset.
-		r = inodes.write(&ctx, f->ip, (u8 *)addr, f->off, n);
-		if (r > 0)
-			f->off += r;
-		inodes.unlock(f->ip);
-		bcache.end_op(&ctx);
+		char *buf = NULL;
+		if (need_bounce(addr, n) && !(buf = kalloc_page()))
+			return -1;
+		while (r < n) {
+			isize m = MIN(n - r, (isize)PAGE_SIZE);
+			if (buf && copy_in(buf, addr + r, m) < 0) {
+				r = r ? r : -1;
+				break;
+			}
+
+			OpContext ctx;
+			bcache.begin_op(&ctx);
+			inodes.lock(f->ip);
+			// Write the inode. On a successful write, update the file offset.
+			isize k = inodes.write(&ctx, f->ip,
+					       (u8 *)(buf ? buf : addr + r), f->off,
+					       m);
+			if (k > 0)
+				f->off += k;
+			inodes.unlock(f->ip);
+			bcache.end_op(&ctx);
+			if (k < 0) {
+				r = r ? r : -1;
+				break;
+			}
+			r += k;
+			if (k < m)
+				break;
+		}
+		if (buf)
+			kfree_page(buf);
 	}
 	// It is illegal to use file_read to read a directory.
 	// Use opendir, readdir, and closedir to perform directory operations.
@@ -3,8 +3,10 @@
 #include <kernel/mem.h>
 #include <lib/printk.h>
 #include <lib/spinlock.h>
+#include <vm/uaccess.h>
 #include <lib/string.h>
 #include <proc/sched.h>
+#include <proc/schedstat.h>
 #include <sys/stat.h>
 
 static const struct super_block *sblock;
@@ -57,6 +59,7 @@ static void init_inode(struct inode *inode)
 	init_list_node(&inode->node);
 	inode->inode_no = 0;
 	inode->valid = false;
+	init_page_cache(&inode->pcache);
 }
 
 static usize inode_alloc(OpContext *ctx, inode_type_t type)
@@ -126,7 +129,7 @@ static struct inode *inode_get(usize inode_no)
 	list_forall(p, cached_inodes)
 	{
 		struct inode *i = container_of(p, struct inode, node);
-		if (i->inode_no == inode_no && i->rc.count > 0 && i->valid) {
+		if (i->inode_no == inode_no && i->valid) {
 			increment_rc(&i->rc);
 			list_unlock(&cached_inodes);
 			return i;
@@ -180,6 +183,7 @@ static void inode_clear(OpContext *ctx, struct inode *inode)
 
 	inode->entry.num_bytes = 0;
 	inode_sync(ctx, inode, true);
+	page_cache_truncate(inode);
 }
 
 static struct inode *inode_share(struct inode *inode)
@@ -211,6 +215,15 @@ static void inode_put(OpContext *ctx, struct inode *inode)
 		kfree(inode);
 		return;
 	}
+	// Drop the last reference. Everyone who maps or reads the file holds a
+	// reference, so the cached pages and the in-memory inode can go with it.
+	if (inode->rc.count == 1) {
+		list_remove(&cached_inodes, &inode->node);
+		list_unlock(&cached_inodes);
+		page_cache_truncate(inode);
+		kfree(inode);
+		return;
+	}
 	decrement_rc(&inode->rc);
 	list_unlock(&cached_inodes);
 }
@@ -285,7 +298,9 @@ static usize inode_read(Inode* inode, u8* dest, usize offset, usize count) {
     InodeEntry* entry = &inode->entry;
 
     if (inode->entry.type == INODE_DEVICE) {
-        ASSERT(inode->entry.major == 1);
+        if (inode->entry.major == SCHEDSTAT_MAJOR)
+            return schedstat_read(inode, (char*)dest, offset, count);
+        ASSERT(inode->entry.major == CONSOLE_MAJOR);
         return console_read(inode, (char*)dest, count);
     }
 
@@ -313,8 +328,11 @@ static usize inode_read(Inode* inode, u8* dest, usize offset, usize count) {
             src = block->data;
         }
 
-        memcpy(dest, src, cnt);
+        // `dest` may be a user buffer. A fault in it ends the read early.
+        int r = copy_out(dest, src, cnt);
         cache->release(block);
+        if (r < 0)
+            return i;
     }
     
     return count;
@@ -328,18 +346,23 @@ static usize inode_write(OpContext* ctx,
     InodeEntry* entry = &inode->entry;
 
     if (entry->type == INODE_DEVICE) {
-        ASSERT(inode->entry.major == 1);
+        // The scheduling statistics are read-only.
+        if (inode->entry.major == SCHEDSTAT_MAJOR)
+            return -1;
+        ASSERT(inode->entry.major == CONSOLE_MAJOR);
         return console_write(inode, (char*)src, count);
     }
 
-    usize end = offset + count;
     ASSERT(offset <= entry->num_bytes);
-    ASSERT(end <= INODE_MAX_BYTES);
+    // A write past the largest file size is cut short.
+    count = MIN(count, INODE_MAX_BYTES - offset);
+    usize end = offset + count;
     ASSERT(offset <= end);
 
     bool modified = FALSE;
     u8* dest;
-    for (usize i = 0, cnt = 0; i < count; i += cnt, src += cnt, offset += cnt) {
+    usize i = 0;
+    for (usize cnt = 0; i < count; i += cnt, src += cnt, offset += cnt) {
         usize block_no = inode_map(ctx, inode, offset / BLOCK_SIZE, &modified);
         Block* block = cache->acquire(block_no);
         if (i == 0) {
@@ -349,15 +372,21 @@ static usize inode_write(OpContext* ctx,
             cnt = MIN((usize)BLOCK_SIZE, count - i);
             dest = block->data;
         }
-        memcpy(dest, src, cnt);
+        // `src` may be a user buffer. A fault in it ends the write early.
+        if (copy_in(dest, src, cnt) < 0) {
+            cache->release(block);
+            break;
+        }
+        page_cache_update(inode, offset, dest, cnt);
         cache->sync(ctx, block);
         cache->release(block);
     }
+    end = offset;
     if (inode->entry.num_bytes < end) {
         inode->entry.num_bytes = end;
         inode_sync(ctx, inode, TRUE);
     }
-    return count;
+    return i;
 }
 
 static usize inode_lookup(Inode* inode, const char* name, usize* index) {
@@ -1,5 +1,6 @@
 #pragma once
 #include <fs/cache.h>
+#include <fs/pagecache.h>
 #include <lib/list.h>
 #include <lib/rc.h>
 #include <lib/spinlock.h>
@@ -48,6 +49,7 @@ struct inode {
 	usize inode_no;
 	bool valid; // Whether the `entry` been loaded from disk.
 	struct dinode entry; // The real in-memory copy of the inode on disk.
+	struct page_cache pcache; // The file data in pages.
 };
 
 /**
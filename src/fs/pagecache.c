@@ -0,0 +1,115 @@
+#include <aarch64/mmu.h>
+#include <fs/inode.h>
+#include <fs/pagecache.h>
+#include <kernel/mem.h>
+#include <lib/string.h>
+
+static bool __page_cmp(rb_node lnode, rb_node rnode)
+{
+	return container_of(lnode, struct cached_page, node)->index <
+	       container_of(rnode, struct cached_page, node)->index;
+}
+
+/* Find the cached page at `index`. The caller must hold the page cache lock. */
+static struct cached_page *__page_cache_lookup(struct page_cache *pc,
+					       usize index)
+{
+	struct cached_page key = { .index = index };
+	rb_node node = _rb_lookup(&key.node, &pc->pages, __page_cmp);
+	return node ? container_of(node, struct cached_page, node) : NULL;
+}
+
+void init_page_cache(struct page_cache *pc)
+{
+	init_spinlock(&pc->lock);
+	pc->pages.rb_node = NULL;
+}
+
+/*
+ * Get the cached page at `index` of `ip`, or NULL if it is not in the cache.
+ * Unlike `page_cache_get`, this never reads from the disk.
+ */
+void *page_cache_lookup(struct inode *ip, usize index)
+{
+	struct page_cache *pc = &ip->pcache;
+
+	acquire_spinlock(&pc->lock);
+	struct cached_page *cp = __page_cache_lookup(pc, index);
+	release_spinlock(&pc->lock);
+	return cp ? cp->kaddr : NULL;
+}
+
+void *page_cache_get(struct inode *ip, usize index)
+{
+	struct page_cache *pc = &ip->pcache;
+
+	if (ip->entry.type == INODE_DEVICE)
+		return NULL;
+
+	acquire_spinlock(&pc->lock);
+	struct cached_page *cp = __page_cache_lookup(pc, index);
+	release_spinlock(&pc->lock);
+	if (cp)
+		return cp->kaddr;
+
+	// Read the page in. The lock of the inode keeps others from inserting the
+	// same page in the meantime. The part beyond the end of the file is zero.
+	cp = kalloc(sizeof(struct cached_page));
+	cp->index = index;
+	cp->kaddr = share_page(kalloc_page());
+	memset(cp->kaddr, 0, PAGE_SIZE);
+	inodes.read(ip, cp->kaddr, index * PAGE_SIZE, PAGE_SIZE);
+
+	acquire_spinlock(&pc->lock);
+	ASSERT(_rb_insert(&cp->node, &pc->pages, __page_cmp) == 0);
+	release_spinlock(&pc->lock);
+	return cp->kaddr;
+}
+
+/**
+ * page_cache_update - keep the cached pages of `ip` in step with a write of
+ * `count` bytes from `src` at `offset`.
+ *
+ * Only pages already in the cache are updated. The caller must hold the lock
+ * of `ip`.
+ */
+void page_cache_update(struct inode *ip, usize offset, const u8 *src,
+		       usize count)
+{
+	struct page_cache *pc = &ip->pcache;
+
+	acquire_spinlock(&pc->lock);
+	while (count > 0) {
+		usize n = MIN(count, PAGE_SIZE - offset % PAGE_SIZE);
+		struct cached_page *cp =
+			__page_cache_lookup(pc, offset / PAGE_SIZE);
+		if (cp)
+			memcpy(cp->kaddr + offset % PAGE_SIZE, src, n);
+		offset += n;
+		src += n;
+		count -= n;
+	}
+	release_spinlock(&pc->lock);
+}
+
+/**
+ * page_cache_truncate - drop all cached pages of `ip`.
+ *
+ * Pages that are still mapped somewhere are freed when they are unmapped. The
+ * caller must hold the lock of `ip`, or its last reference.
+ */
+void page_cache_truncate(struct inode *ip)
+{
+	struct page_cache *pc = &ip->pcache;
+
+	acquire_spinlock(&pc->lock);
+	rb_node node;
+	while ((node = _rb_first(&pc->pages))) {
+		struct cached_page *cp =
+			container_of(node, struct cached_page, node);
+		_rb_erase(node, &pc->pages);
+		put_page(cp->kaddr);
+		kfree(cp);
+	}
+	release_spinlock(&pc->lock);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <lib/defines.h>
+#include <lib/rbtree.h>
+#include <lib/spinlock.h>
+
+struct inode;
+
+/**
+ * cached_page - a page of file data in the page cache.
+ *
+ * @node: link this page into the page cache of its inode.
+ * @index: the file offset of the page, in pages.
+ * @kaddr: the kernel address of the page.
+ */
+struct cached_page {
+	struct rb_node_ node;
+	usize index;
+	void *kaddr;
+};
+
+/**
+ * page_cache - the per-inode cache of file data in 4 KiB pages.
+ *
+ * Unlike the block cache, pages are indexed by file offset rather than by disk
+ * block, so that file-backed mappings can map them directly. The cache holds a
+ * reference to each of its pages (see `struct page.ref`), and every mapping of
+ * a page holds another one.
+ *
+ * @lock: protects `pages`. Pages are only read in from disk with the lock of
+ * the inode held.
+ * @pages: the cached pages ordered by `index`.
+ */
+struct page_cache {
+	struct spinlock lock;
+	struct rb_root_ pages;
+};
+
+void init_page_cache(struct page_cache *pc);
+WARN_RESULT void *page_cache_lookup(struct inode *ip, usize index);
+WARN_RESULT void *page_cache_get(struct inode *ip, usize index);
+void page_cache_update(struct inode *ip, usize offset, const u8 *src,
+		       usize count);
+void page_cache_truncate(struct inode *ip);
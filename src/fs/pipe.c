@@ -1,10 +1,14 @@
+#include <fs/cache.h>
 #include <fs/file.h>
+#include <fs/inode.h>
+#include <fs/pagecache.h>
 #include <fs/pipe.h>
 #include <kernel/mem.h>
 #include <lib/cond.h>
 #include <lib/string.h>
 #include <proc/sched.h>
 #include <lib/printk.h>
+#include <vm/uaccess.h>
 
 int pipe_alloc(struct file **f0, struct file **f1)
 {
@@ -14,19 +18,22 @@ int pipe_alloc(struct file **f0, struct file **f1)
 		PANIC();
 	if (!(pi = (struct pipe *)kalloc(sizeof(struct pipe))))
 		PANIC();
-	// Initialize the pipe.
-	pi->readopen = 1;
-	pi->writeopen = 1;
-	pi->nwrite = 0;
-	pi->nread = 0;
+	for (int i = 0; i < PIPE_PAGES; i++)
+		if (!(pi->pages[i] = share_page(kalloc_page())))
+			PANIC();
 
+	// Initialize the pipe.
 	init_spinlock(&pi->lock);
 	init_sem(&(pi->wlock), 0);
 	init_sem(&(pi->rlock), 0);
+	init_sem(&(pi->rmutex), 1);
+	init_sem(&(pi->wmutex), 1);
 	pi->nread = 0;
 	pi->nwrite = 0;
 	pi->readopen = 1;
 	pi->writeopen = 1;
+	pi->wwaiting = false;
+	pi->rwaiting = false;
 
 	// Initialize the file descriptors of the pipe.
 	(*f0)->type = FD_PIPE;
@@ -44,67 +51,378 @@ void pipe_close(struct pipe *pi, int writable)
 {
 	acquire_spinlock(&pi->lock);
 	if (writable) {
-		pi->writeopen = 0;
+		__atomic_store_n(&pi->writeopen, 0, __ATOMIC_RELAXED);
 		cond_broadcast(&pi->rlock);
 	} else {
-		pi->readopen = 0;
+		__atomic_store_n(&pi->readopen, 0, __ATOMIC_RELAXED);
 		cond_broadcast(&pi->wlock);
 	}
 
 	if (pi->readopen == 0 && pi->writeopen == 0) {
 		release_spinlock(&pi->lock);
+		for (int i = 0; i < PIPE_PAGES; i++)
+			put_page(pi->pages[i]);
 		kfree((void *)pi);
 	} else {
 		release_spinlock(&pi->lock);
 	}
 }
 
-int pipe_write(struct pipe *pi, u64 addr, int n)
+/* The slot of the page that holds byte `pos` of the stream. */
+static void **pipe_slot(struct pipe *pi, u32 pos)
+{
+	return &pi->pages[pos / PAGE_SIZE % PIPE_PAGES];
+}
+
+static bool page_shared(void *ka)
+{
+	return get_page_info_by_kaddr(ka)->ref.count > 1;
+}
+
+/* Whether a reader would not have to wait. Called by readers. */
+static bool pipe_readable(struct pipe *pi)
+{
+	return __atomic_load_n(&pi->nwrite, __ATOMIC_ACQUIRE) != pi->nread ||
+	       !__atomic_load_n(&pi->writeopen, __ATOMIC_RELAXED);
+}
+
+/*
+ * The number of bytes that can be written without waiting. Called by writers.
+ * A shared page at the write end only counts once it has been read completely,
+ * since it has to be replaced rather than written.
+ */
+static u32 pipe_space(struct pipe *pi)
+{
+	u32 nread = __atomic_load_n(&pi->nread, __ATOMIC_ACQUIRE);
+	u32 space = PIPE_SIZE - (pi->nwrite - nread);
+	if (pi->nwrite % PAGE_SIZE == 0 && space < PAGE_SIZE &&
+	    page_shared(*pipe_slot(pi, pi->nwrite)))
+		return 0;
+	return space;
+}
+
+/*
+ * Wake up the waiters on `cond` if `waiting` says there are any. The fence
+ * pairs with the one in `pipe_wait_readable` or `pipe_wait_writable`: either
+ * the waiter sees the bytes just moved, or we see its flag.
+ */
+static void pipe_wake(struct pipe *pi, bool *waiting, struct semaphore *cond,
+		      bool locked)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(waiting, __ATOMIC_RELAXED))
+		return;
+	if (!locked)
+		acquire_spinlock(&pi->lock);
+	*waiting = false;
+	cond_broadcast(cond);
+	if (!locked)
+		release_spinlock(&pi->lock);
+}
+
+/*
+ * Wait until there is something to read or no writer is left. Returns -1 if
+ * the process is killed in the meantime.
+ */
+static int pipe_wait_readable(struct pipe *pi, bool locked)
+{
+	int r = 0;
+
+	if (pipe_readable(pi))
+		return 0;
+	if (!locked)
+		acquire_spinlock(&pi->lock);
+	while (!pipe_readable(pi)) {
+		if (thisproc()->killed) {
+			r = -1;
+			break;
+		}
+		__atomic_store_n(&pi->rwaiting, true, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (!pipe_readable(pi))
+			cond_wait(&pi->rlock, &pi->lock);
+	}
+	if (!locked)
+		release_spinlock(&pi->lock);
+	return r;
+}
+
+/*
+ * Wait until there is space to write. Returns -1 if there is no reader left or
+ * the process is killed.
+ */
+static int pipe_wait_writable(struct pipe *pi, bool locked)
+{
+	int r = 0;
+
+	if (__atomic_load_n(&pi->readopen, __ATOMIC_RELAXED) &&
+	    !thisproc()->killed && pipe_space(pi) > 0)
+		return 0;
+	if (!locked)
+		acquire_spinlock(&pi->lock);
+	for (;;) {
+		if (pi->readopen == 0 || thisproc()->killed) {
+			r = -1;
+			break;
+		}
+		if (pipe_space(pi) > 0)
+			break;
+		__atomic_store_n(&pi->wwaiting, true, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (pipe_space(pi) == 0)
+			cond_wait(&pi->wlock, &pi->lock);
+	}
+	if (!locked)
+		release_spinlock(&pi->lock);
+	return r;
+}
+
+/*
+ * Get the page to write the byte at `nwrite` into, replacing a shared page by a
+ * fresh one. There must be space in the pipe.
+ */
+static void *pipe_write_page(struct pipe *pi)
+{
+	void **slot = pipe_slot(pi, pi->nwrite);
+	if (pi->nwrite % PAGE_SIZE == 0 && page_shared(*slot)) {
+		put_page(*slot);
+		if (!(*slot = share_page(kalloc_page())))
+			PANIC();
+	}
+	return *slot;
+}
+
+/* Make `m` more bytes visible to the readers. */
+static void pipe_produce(struct pipe *pi, u32 m, bool locked)
+{
+	__atomic_store_n(&pi->nwrite, pi->nwrite + m, __ATOMIC_RELEASE);
+	pipe_wake(pi, &pi->rwaiting, &pi->rlock, locked);
+}
+
+/* Give `m` bytes back to the writers. */
+static void pipe_consume(struct pipe *pi, u32 m, bool locked)
+{
+	__atomic_store_n(&pi->nread, pi->nread + m, __ATOMIC_RELEASE);
+	pipe_wake(pi, &pi->wwaiting, &pi->wlock, locked);
+}
+
+/*
+ * Write `n` bytes at `addr` into `pi`. The caller is the only writer. Returns
+ * the number of bytes written, or -1 if none could be written.
+ */
+static int __pipe_write(struct pipe *pi, u64 addr, int n)
 {
 	int i = 0;
-	struct proc *pr = thisproc();
 
-	acquire_spinlock(&pi->lock);
 	while (i < n) {
-		if (pi->readopen == 0 || pr->killed) {
+		if (pipe_wait_writable(pi, false) < 0)
+			return i > 0 ? i : -1;
+
+		// Copy as much as fits before the end of the page.
+		u32 off = pi->nwrite % PAGE_SIZE;
+		int m = MIN((u32)(n - i), MIN(pipe_space(pi), PAGE_SIZE - off));
+		if (copy_in(pipe_write_page(pi) + off, (void *)(addr + i), m) <
+		    0)
+			return i > 0 ? i : -1;
+		pipe_produce(pi, m, false);
+		i += m;
+	}
+	return i;
+}
+
+/*
+ * Write `n` bytes at `addr` into `pi`. `exclusive` says that the caller is the
+ * only writer. Otherwise, the writers take turns with `wmutex`.
+ */
+int pipe_write(struct pipe *pi, u64 addr, int n, bool exclusive)
+{
+	if (exclusive)
+		return __pipe_write(pi, addr, n);
+
+	if (!wait_sem(&pi->wmutex))
+		return -1;
+	int r = __pipe_write(pi, addr, n);
+	post_sem(&pi->wmutex);
+	return r;
+}
+
+/*
+ * Read up to `n` bytes of `pi` into `addr`. The caller is the only reader.
+ * Bytes are only consumed once they are copied, so a fault loses nothing.
+ */
+static int __pipe_read(struct pipe *pi, u64 addr, int n)
+{
+	int i = 0;
+	u32 avail;
+
+	if (pipe_wait_readable(pi, false) < 0)
+		return -1;
+
+	while (i < n && (avail = __atomic_load_n(&pi->nwrite, __ATOMIC_ACQUIRE) -
+				 pi->nread) > 0) {
+		// Copy as much as is there before the end of the page.
+		u32 off = pi->nread % PAGE_SIZE;
+		int m = MIN((u32)(n - i), MIN(avail, PAGE_SIZE - off));
+		if (copy_out((void *)(addr + i), *pipe_slot(pi, pi->nread) + off,
+			     m) < 0)
+			return i > 0 ? i : -1;
+		pipe_consume(pi, m, false);
+		i += m;
+	}
+	return i;
+}
+
+/* Like `pipe_write`, `exclusive` says that the caller is the only reader. */
+int pipe_read(struct pipe *pi, u64 addr, int n, bool exclusive)
+{
+	if (exclusive)
+		return __pipe_read(pi, addr, n);
+
+	if (!wait_sem(&pi->rmutex))
+		return -1;
+	int r = __pipe_read(pi, addr, n);
+	post_sem(&pi->rmutex);
+	return r;
+}
+
+static isize __splice_to_pipe(struct pipe *pi, struct inode *ip, usize *off,
+			      usize len)
+{
+	usize i = 0;
+
+	while (i < len) {
+		if (pipe_wait_writable(pi, false) < 0)
+			return i > 0 ? (isize)i : -1;
+
+		// Read the page in before taking the spinlock of the pipe.
+		inodes.lock(ip);
+		if (*off >= ip->entry.num_bytes) {
+			inodes.unlock(ip);
+			break;
+		}
+		usize n = MIN(len - i, ip->entry.num_bytes - *off);
+		void *page = page_cache_get(ip, *off / PAGE_SIZE);
+		usize poff = *off % PAGE_SIZE;
+		if (!page) {
+			inodes.unlock(ip);
+			return i > 0 ? (isize)i : -1;
+		}
+
+		// The last reader may have gone in the meantime.
+		acquire_spinlock(&pi->lock);
+		u32 space = pipe_space(pi);
+		if (pi->readopen == 0 || space == 0) {
 			release_spinlock(&pi->lock);
-			return -1;
+			inodes.unlock(ip);
+			continue;
 		}
 
-		if (pi->nwrite == pi->nread + PIPE_SIZE) {
-			cond_broadcast(&pi->rlock);
-			cond_wait(&pi->wlock, &pi->lock);
+		u32 woff = pi->nwrite % PAGE_SIZE;
+		usize m;
+		if (poff == 0 && woff == 0 && n >= PAGE_SIZE &&
+		    space >= PAGE_SIZE) {
+			void **slot = pipe_slot(pi, pi->nwrite);
+			put_page(*slot);
+			*slot = share_page(page);
+			m = PAGE_SIZE;
 		} else {
-			pi->data[pi->nwrite++ % PIPE_SIZE] =
-				*(char *)(addr + i);
-			i++;
+			m = MIN(n, MIN(PAGE_SIZE - poff,
+				       MIN(space, PAGE_SIZE - woff)));
+			memcpy(pipe_write_page(pi) + woff, page + poff, m);
 		}
+		pipe_produce(pi, m, true);
+		release_spinlock(&pi->lock);
+		inodes.unlock(ip);
+
+		*off += m;
+		i += m;
 	}
-	cond_broadcast(&pi->rlock);
-	release_spinlock(&pi->lock);
 	return i;
 }
 
-int pipe_read(struct pipe *pi, u64 addr, int n)
+/**
+ * splice_to_pipe - move up to `len` bytes of `ip` at `*off` into `pi`.
+ *
+ * The data comes from the page cache. A whole page of the file that lands on a
+ * page boundary of the pipe is not copied: the pipe takes a reference to the
+ * cached page instead. Later writes to the file may still show through such a
+ * page until it is read.
+ *
+ * The caller must not hold the lock of `ip`: it is only taken once there is
+ * space in the pipe, so that a full pipe does not hold up the file. `*off` is
+ * advanced past the bytes moved. Returns the number of bytes moved, or -1 if
+ * none could be moved because there is no reader or on error.
+ */
+isize splice_to_pipe(struct pipe *pi, struct inode *ip, usize *off, usize len)
+{
+	if (!wait_sem(&pi->wmutex))
+		return -1;
+	isize r = __splice_to_pipe(pi, ip, off, len);
+	post_sem(&pi->wmutex);
+	return r;
+}
+
+static isize __splice_from_pipe(struct pipe *pi, struct inode *ip,
+				usize *off, usize len)
 {
-	int i;
-	struct proc *pr = thisproc();
+	usize i = 0;
+	u32 avail;
 
 	acquire_spinlock(&pi->lock);
-	while (pi->nread == pi->nwrite && pi->writeopen) {
-		if (pr->killed) {
-			release_spinlock(&pi->lock);
-			return -1;
-		}
-		cond_wait(&pi->rlock, &pi->lock);
+	if (pipe_wait_readable(pi, true) < 0) {
+		release_spinlock(&pi->lock);
+		return -1;
 	}
 
-	for (i = 0; i < n; i++) {
-		if (pi->nread == pi->nwrite)
-			break;
-		*(char *)(addr + i) = pi->data[pi->nread++ % PIPE_SIZE];
+	while (i < len && (avail = __atomic_load_n(&pi->nwrite, __ATOMIC_ACQUIRE) -
+				   pi->nread) > 0) {
+		u32 roff = pi->nread % PAGE_SIZE;
+		usize m = MIN(len - i, MIN(avail, PAGE_SIZE - roff));
+		// Hold a reference, so that a writer that wraps around to the page
+		// replaces it rather than overwriting it while it is written out.
+		void *page = share_page(*pipe_slot(pi, pi->nread));
+		pipe_consume(pi, m, true);
+		release_spinlock(&pi->lock);
+
+		OpContext ctx;
+		bool ok;
+		bcache.begin_op(&ctx);
+		inodes.lock(ip);
+		ok = ip->entry.type == INODE_DEVICE ||
+		     (*off <= ip->entry.num_bytes &&
+		      *off + m <= INODE_MAX_BYTES);
+		if (ok)
+			ok = inodes.write(&ctx, ip, page + roff, *off, m) == m;
+		inodes.unlock(ip);
+		bcache.end_op(&ctx);
+		put_page(page);
+		if (!ok)
+			return i > 0 ? (isize)i : -1;
+
+		*off += m;
+		i += m;
+		acquire_spinlock(&pi->lock);
 	}
-	cond_broadcast(&pi->wlock);
 	release_spinlock(&pi->lock);
 	return i;
-}
\ No newline at end of file
+}
+
+/**
+ * splice_from_pipe - move up to `len` bytes out of `pi` into `ip` at `*off`.
+ *
+ * The data is written to the file straight from the pages of the pipe. Like
+ * `pipe_read`, this only waits while the pipe is empty and returns 0 once the
+ * pipe is empty and has no writer.
+ *
+ * The caller must not hold the lock of `ip`. `*off` is advanced past the bytes
+ * moved. Returns the number of bytes moved, or -1 on error.
+ */
+isize splice_from_pipe(struct pipe *pi, struct inode *ip, usize *off,
+		       usize len)
+{
+	if (!wait_sem(&pi->rmutex))
+		return -1;
+	isize r = __splice_from_pipe(pi, ip, off, len);
+	post_sem(&pi->rmutex);
+	return r;
+}
@@ -1,27 +1,61 @@
 #ifndef _PIPE_H
 #define _PIPE_H
 
+#include <aarch64/mmu.h>
 #include <fs/file.h>
 #include <lib/defines.h>
 #include <lib/sem.h>
 #include <lib/spinlock.h>
 
-#define PIPE_SIZE 512
+#define PIPE_PAGES 4
+#define PIPE_SIZE (PIPE_PAGES * PAGE_SIZE)
 
+struct inode;
+
+/**
+ * pipe - a ring of `PIPE_PAGES` pages.
+ *
+ * Byte `i` of the stream lives at offset `i % PAGE_SIZE` of page
+ * `pages[i / PAGE_SIZE % PIPE_PAGES]`. The pipe holds a reference to each of
+ * its pages (see `struct page.ref`). A page that someone else also holds, e.g.
+ * a page of the page cache spliced into the pipe, is never written. It is
+ * replaced by a fresh page once it has been read completely.
+ *
+ * `nread` is only advanced by readers and `nwrite` only by writers, with
+ * release stores that pair with acquire loads on the other side. An end with a
+ * single reader or writer therefore needs no lock: `rmutex` (`wmutex`)
+ * serializes the readers (writers) of an end only while it is shared, and
+ * `lock` only guards sleeping and waking up. The user buffer is then copied
+ * with no spinlock held.
+ *
+ * @wlock: writers wait here while the pipe is full.
+ * @rlock: readers wait here while the pipe is empty.
+ * @wwaiting: set by a writer before it waits on `wlock`.
+ * @rwaiting: set by a reader before it waits on `rlock`.
+ * @rmutex: held by a reader of a shared end, or a splice out of the pipe.
+ * @wmutex: held by a writer of a shared end, or a splice into the pipe.
+ */
 struct pipe {
 	struct spinlock lock;
 	struct semaphore wlock;
 	struct semaphore rlock;
-	char data[PIPE_SIZE];
+	struct semaphore rmutex;
+	struct semaphore wmutex;
+	void *pages[PIPE_PAGES];
 	u32 nread; // number of bytes read
 	u32 nwrite; // number of bytes written
 	int readopen; // read fd is still open
 	int writeopen; // write fd is still open
+	bool wwaiting;
+	bool rwaiting;
 };
 
 int pipe_alloc(struct file **f0, struct file **f1);
 void pipe_close(struct pipe *pi, int writable);
-int pipe_write(struct pipe *pi, u64 addr, int n);
-int pipe_read(struct pipe *pi, u64 addr, int n);
+int pipe_write(struct pipe *pi, u64 addr, int n, bool exclusive);
+int pipe_read(struct pipe *pi, u64 addr, int n, bool exclusive);
+isize splice_to_pipe(struct pipe *pi, struct inode *ip, usize *off, usize len);
+isize splice_from_pipe(struct pipe *pi, struct inode *ip, usize *off,
+		       usize len);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,19 @@
+extern "C" {
+#include <lib/defines.h>
+}
+
+#include <cstring>
+
+// The tests only pass buffers of their own, which are always accessible.
+
+extern "C" {
+int copy_out(void* dst, const void* src, usize n) {
+    memcpy(dst, src, n);
+    return 0;
+}
+
+int copy_in(void* dst, const void* src, usize n) {
+    memcpy(dst, src, n);
+    return 0;
+}
+}
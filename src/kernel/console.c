@@ -9,6 +9,7 @@
 #include <kernel/param.h>
 #include <lib/printk.h>
 #include <kernel/mem.h>
+#include <vm/uaccess.h>
 
 struct console cons;
 extern struct list blocks;
@@ -32,13 +33,23 @@ isize console_write(struct inode *ip, char *buf, isize n)
 	if (ip->entry.type != INODE_DEVICE)
 		return -1;
 
+	// The buffer may be in user memory, which is copied in before the lock is
+	// taken, since touching it may fault.
+	char chunk[64];
+	isize i = 0;
 	inodes.unlock(ip);
-	acquire_spinlock(&cons.lock);
-	for (isize i = 0; i < n; i++)
-		uart_put_char(buf[i]);
-	release_spinlock(&cons.lock);
+	while (i < n) {
+		isize m = MIN(n - i, (isize)sizeof(chunk));
+		if (copy_in(chunk, buf + i, m) < 0)
+			break;
+		acquire_spinlock(&cons.lock);
+		for (isize j = 0; j < m; j++)
+			uart_put_char(chunk[j]);
+		release_spinlock(&cons.lock);
+		i += m;
+	}
 	inodes.lock(ip);
-	return n;
+	return i;
 }
 
 /**
@@ -49,36 +60,53 @@ isize console_write(struct inode *ip, char *buf, isize n)
  */
 isize console_read(struct inode *ip, char *dst, isize n)
 {
-	usize target = n;
+	// The chars are staged in `chunk` and copied out once the lock is
+	// released, since touching `dst` may fault.
+	char chunk[64];
+	isize i = 0;
+	bool done = false;
+
 	inodes.unlock(ip);
-	acquire_spinlock(&cons.lock);
-	while (n > 0) {
-		// It is well worth discussion that if it is a good idea to use a
-		// condition variable here. After all, I am unable to imagine a
-		// situation where there are multiple consoles in this tiny kernel.
-		while (cons.read_idx == cons.write_idx) {
-			cond_wait(&cons.sem, &cons.lock);
-			release_spinlock(&cons.lock);
-		}
+	while (i < n && !done) {
+		isize m = 0;
+		acquire_spinlock(&cons.lock);
+		while (m < MIN(n - i, (isize)sizeof(chunk))) {
+			// It is well worth discussion that if it is a good idea to use a
+			// condition variable here. After all, I am unable to imagine a
+			// situation where there are multiple consoles in this tiny
+			// kernel. Chars already staged are handed out before waiting.
+			if (cons.read_idx == cons.write_idx) {
+				if (m > 0)
+					break;
+				cond_wait(&cons.sem, &cons.lock);
+				continue;
+			}
 
-		// Read the char from the buffer.
-		char c = cons.buf[cons.read_idx++ % INPUT_BUF_SIZE];
+			// Read the char from the buffer.
+			char c = cons.buf[cons.read_idx++ % INPUT_BUF_SIZE];
 
-		// If the char is EoF, end here. Otherwise, copy the char from the
-		// buffer to destination.
-		if (c == C('D'))
-			break;
-		dst[target - n] = c;
-		n--;
+			// If the char is EoF, end here. Otherwise, stage the char.
+			if (c == C('D')) {
+				done = true;
+				break;
+			}
+			chunk[m++] = c;
 
-		// The console also ends reading on a new line. However, the `\n` should
-		// be read into the desination.
-		if (c == '\n')
+			// The console also ends reading on a new line. However, the `\n`
+			// should be read into the desination.
+			if (c == '\n') {
+				done = true;
+				break;
+			}
+		}
+		release_spinlock(&cons.lock);
+
+		if (copy_out(dst + i, chunk, m) < 0)
 			break;
+		i += m;
 	}
-	release_spinlock(&cons.lock);
 	inodes.lock(ip);
-	return target - n;
+	return i;
 }
 
 void console_intr()
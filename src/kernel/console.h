@@ -5,6 +5,7 @@
 #include <kernel/param.h>
 
 #define BACKSPACE 0x100
+#define CONSOLE_MAJOR 1
 #define C(x) ((x) - '@')
 
 extern InodeTree inodes;
@@ -19,9 +19,11 @@ NO_RETURN void idle_entry()
 		yield();
 		if (panic_flag)
 			break;
+		// There is no slice timer while idle. Processes queued here from
+		// another CPU come with an IPI, which wakes us up.
 		arch_with_trap
 		{
-			arch_wfi();
+			arch_wfe();
 		}
 	}
 	set_cpu_off();
@@ -67,6 +69,8 @@ void kernel_entry()
 	// user_proc_test();
 	// pgfault_first_test();
 	// pgfault_second_test();
+	// string_test();
+	// sem_test();
 	do_rest_init();
 
 	set_user_init();
@@ -1,5 +1,6 @@
 #include <aarch64/mmu.h>
 #include <driver/clock.h>
+#include <driver/interrupt.h>
 #include <kernel/cpu.h>
 #include <kernel/init.h>
 #include <lib/printk.h>
@@ -8,74 +9,294 @@
 
 struct cpu cpus[NCPU];
 
-static struct timer hello_timer[4];
+/* With no timer due sooner, the clock still fires this often, in ms. */
+#define TIMER_MAX_COUNTDOWN 1000
 
-static bool __timer_cmp(rb_node lnode, rb_node rnode)
+define_early_init(timer_base)
 {
-	i64 d = container_of(lnode, struct timer, _node)->_key -
-		container_of(rnode, struct timer, _node)->_key;
-	if (d < 0)
-		return true;
-	if (d == 0)
-		return lnode < rnode;
-	return false;
+	for (int i = 0; i < NCPU; i++) {
+		struct timer_base *base = &cpus[i].timer;
+		for (int j = 0; j < TIMER_LVL_DEPTH * TIMER_LVL_SIZE; j++)
+			init_list_node(&base->vec[j]);
+		base->next_expiry = (u64)-1;
+		base->programmed = (u64)-1;
+	}
 }
 
-static void __timer_set_clock()
+/* Program the clock to fire at `next_expiry`, or within TIMER_MAX_COUNTDOWN. */
+static void __timer_program(struct timer_base *base)
 {
-	auto node = _rb_first(&cpus[cpuid()].timer);
-	if (!node) {
-		reset_clock(1000);
-		return;
+	u64 now = get_timestamp_ms();
+	u64 next = MIN(base->next_expiry, now + TIMER_MAX_COUNTDOWN);
+
+	base->programmed = next;
+	reset_clock(next > now ? next - now : 0);
+}
+
+/*
+ * Put `timer` into the first level whose buckets reach its expiry without
+ * wrapping around. The bucket is rounded up, so that the timer never fires
+ * early. A timer beyond the last level goes into its last bucket, and is put
+ * back when that bucket runs. The clock is only reprogrammed if the timer is
+ * due before it fires.
+ */
+static void __timer_enqueue(struct timer_base *base, struct timer *timer)
+{
+	u64 expires = MAX(timer->_key, base->clk), bucket = 0;
+	int lvl;
+
+	for (lvl = 0; lvl < TIMER_LVL_DEPTH; lvl++) {
+		bucket = (expires + TIMER_LVL_GRAN(lvl) - 1) >> TIMER_LVL_SHIFT(lvl);
+		if (bucket - (base->clk >> TIMER_LVL_SHIFT(lvl)) < TIMER_LVL_SIZE)
+			break;
+	}
+	if (lvl == TIMER_LVL_DEPTH) {
+		lvl--;
+		bucket = (base->clk >> TIMER_LVL_SHIFT(lvl)) + TIMER_LVL_SIZE - 1;
+	}
+
+	int idx = bucket & TIMER_LVL_MASK;
+	timer->_idx = lvl * TIMER_LVL_SIZE + idx;
+	_insert_into_list(base->vec[timer->_idx].prev, &timer->_node);
+	base->pending[lvl] |= 1ull << idx;
+
+	expires = bucket << TIMER_LVL_SHIFT(lvl);
+	base->next_expiry = MIN(base->next_expiry, expires);
+	if (expires < base->programmed)
+		__timer_program(base);
+}
+
+static void __timer_detach(struct timer_base *base, struct timer *timer)
+{
+	_detach_from_list(&timer->_node);
+	if (_empty_list(&base->vec[timer->_idx]))
+		base->pending[timer->_idx / TIMER_LVL_SIZE] &=
+			~(1ull << (timer->_idx % TIMER_LVL_SIZE));
+}
+
+/* Find when the first non-empty bucket at or after `clk` is due. */
+static u64 __timer_next_expiry(struct timer_base *base)
+{
+	u64 next = (u64)-1;
+
+	for (int lvl = 0; lvl < TIMER_LVL_DEPTH; lvl++) {
+		u64 map = base->pending[lvl];
+		if (!map)
+			continue;
+		u64 clk = (base->clk + TIMER_LVL_GRAN(lvl) - 1) >>
+			  TIMER_LVL_SHIFT(lvl);
+		int pos = clk & TIMER_LVL_MASK;
+		if (pos)
+			map = (map >> pos) | (map << (TIMER_LVL_SIZE - pos));
+		next = MIN(next, (clk + __builtin_ctzll(map))
+					 << TIMER_LVL_SHIFT(lvl));
+	}
+	return next;
+}
+
+/*
+ * Catch `clk` up with `now` while no timer is due, so that a new timer lands
+ * on the finest level it can.
+ */
+static void __timer_forward(struct timer_base *base, u64 now)
+{
+	if (base->next_expiry > now && base->clk < now)
+		base->clk = now;
+}
+
+/*
+ * Take a due timer off the wheel and mark it running, or return NULL if there
+ * is none by `now`. The buckets of a level run when `clk` reaches their time,
+ * and the empty stretches of the wheel are skipped. A timer that another CPU
+ * is cancelling is only taken off: the `cancelled` list finishes it.
+ */
+static struct timer *__timer_pop_expired(struct timer_base *base, u64 now)
+{
+	while (base->clk <= now) {
+		for (int lvl = 0; lvl < TIMER_LVL_DEPTH; lvl++) {
+			if (base->clk & (TIMER_LVL_GRAN(lvl) - 1))
+				break;
+			int idx = lvl * TIMER_LVL_SIZE +
+				  ((base->clk >> TIMER_LVL_SHIFT(lvl)) &
+				   TIMER_LVL_MASK);
+			if (_empty_list(&base->vec[idx]))
+				continue;
+			struct timer *timer =
+				container_of(base->vec[idx].next, struct timer,
+					     _node);
+			int state = TIMER_PENDING;
+			__timer_detach(base, timer);
+			if (timer->_key > now)
+				__timer_enqueue(base, timer);
+			else if (__atomic_compare_exchange_n(
+					 &timer->_state, &state, TIMER_RUNNING,
+					 false, __ATOMIC_ACQ_REL,
+					 __ATOMIC_ACQUIRE))
+				return timer;
+			lvl--;
+		}
+		base->clk++;
+		base->next_expiry = __timer_next_expiry(base);
+		if (base->next_expiry > base->clk)
+			base->clk = MIN(base->next_expiry, now + 1);
+	}
+	return NULL;
+}
+
+/*
+ * Serve the requests of other CPUs: move the timers they set for this one onto
+ * the wheel, and take off those they cancel. The cancelled timers are taken
+ * first. A timer is set before it is cancelled, so it is then in `incoming`
+ * already, and does not stay there once cancelled.
+ */
+static void __timer_drain(struct timer_base *base)
+{
+	struct timer *cancelled =
+		__atomic_exchange_n(&base->cancelled, NULL, __ATOMIC_ACQUIRE);
+	struct timer *timer =
+		__atomic_exchange_n(&base->incoming, NULL, __ATOMIC_ACQUIRE);
+
+	while (timer) {
+		struct timer *next = timer->_next;
+		if (__atomic_load_n(&timer->_state, __ATOMIC_ACQUIRE) !=
+		    TIMER_CANCELLING) {
+			__timer_forward(base, get_timestamp_ms());
+			__timer_enqueue(base, timer);
+		}
+		timer = next;
+	}
+	while (cancelled) {
+		struct timer *next = cancelled->_cancel_next;
+		__timer_detach(base, cancelled);
+		__atomic_store_n(&cancelled->_state, TIMER_IDLE,
+				 __ATOMIC_RELEASE);
+		cancelled = next;
 	}
-	auto t1 = container_of(node, struct timer, _node)->_key;
-	auto t0 = get_timestamp_ms();
-	if (t1 <= t0)
-		reset_clock(0);
-	else
-		reset_clock(t1 - t0);
 }
 
+/*
+ * Run the due timers of this CPU. A handler may switch to another process, and
+ * this one may go on later on another CPU, so the wheel is looked up again
+ * after each handler, and the clock is programmed before it.
+ */
 static void timer_clock_handler()
 {
-	while (1) {
-		auto node = _rb_first(&cpus[cpuid()].timer);
-		if (!node)
-			break;
-		auto timer = container_of(node, struct timer, _node);
-		if (get_timestamp_ms() < timer->_key)
-			break;
-		cancel_cpu_timer(timer);
+	struct timer *timer;
+
+	__timer_drain(&cpus[cpuid()].timer);
+	while ((timer = __timer_pop_expired(&cpus[cpuid()].timer,
+					    get_timestamp_ms()))) {
+		__timer_program(&cpus[cpuid()].timer);
 		timer->triggered = true;
 		timer->handler(timer);
+		// The handler may have set the timer again.
+		int state = TIMER_RUNNING;
+		__atomic_compare_exchange_n(&timer->_state, &state, TIMER_IDLE,
+					    false, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED);
 	}
+	__timer_program(&cpus[cpuid()].timer);
+}
+
+static void __timer_ipi_handler()
+{
+	__timer_drain(&cpus[cpuid()].timer);
 }
 
 define_early_init(clock_handler)
 {
 	set_clock_handler(&timer_clock_handler);
+	set_ipi_handler(IPI_TIMER, __timer_ipi_handler);
 }
 
 void set_cpu_timer(struct timer *timer)
 {
+	struct timer_base *base = &cpus[cpuid()].timer;
+	u64 now = get_timestamp_ms();
+
 	timer->triggered = false;
-	timer->_key = get_timestamp_ms() + timer->elapse;
-	ASSERT(0 ==
-	       _rb_insert(&timer->_node, &cpus[cpuid()].timer, __timer_cmp));
-	__timer_set_clock();
+	timer->_key = now + timer->elapse;
+	timer->_cpu = cpuid();
+	__atomic_store_n(&timer->_state, TIMER_PENDING, __ATOMIC_RELAXED);
+	__timer_forward(base, now);
+	__timer_enqueue(base, timer);
 }
 
-void cancel_cpu_timer(struct timer *timer)
+/*
+ * Set `timer` on another CPU. It is pushed onto the `incoming` stack of that
+ * CPU, which puts it on its wheel when it takes the IPI.
+ */
+void set_cpu_timer_on(int cpu, struct timer *timer)
 {
-	ASSERT(!timer->triggered);
-	_rb_erase(&timer->_node, &cpus[cpuid()].timer);
-	__timer_set_clock();
+	if (cpu == cpuid()) {
+		set_cpu_timer(timer);
+		return;
+	}
+
+	struct timer_base *base = &cpus[cpu].timer;
+	timer->triggered = false;
+	timer->_key = get_timestamp_ms() + timer->elapse;
+	timer->_cpu = cpu;
+	init_list_node(&timer->_node);
+	__atomic_store_n(&timer->_state, TIMER_PENDING, __ATOMIC_RELAXED);
+	timer->_next = __atomic_load_n(&base->incoming, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&base->incoming, &timer->_next,
+					    timer, true, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED))
+		;
+	send_ipi(cpu, IPI_TIMER);
 }
 
-static void hello(struct timer *t)
+/*
+ * Cancel `timer`, from any CPU. Returns whether it was cancelled before it
+ * fired. The clock is left alone: if it fires for nothing, the wheel is merely
+ * caught up.
+ *
+ * A timer of another CPU is handed over to it through `cancelled`. If its
+ * handler is running there, we wait for it to return, so that the timer can be
+ * freed afterwards. Such a handler must not sleep. While waiting, we serve the
+ * requests of other CPUs, so that two CPUs cancelling each other's timers do
+ * not deadlock.
+ */
+bool cancel_cpu_timer(struct timer *timer)
 {
-	t->data++;
-	set_cpu_timer(&hello_timer[cpuid()]);
+	struct timer_base *base = &cpus[cpuid()].timer;
+
+	while (1) {
+		int state = __atomic_load_n(&timer->_state, __ATOMIC_ACQUIRE);
+		bool local = timer->_cpu == cpuid();
+
+		if (state == TIMER_IDLE || (local && state == TIMER_RUNNING))
+			return false;
+		if (state == TIMER_PENDING && local &&
+		    __atomic_compare_exchange_n(&timer->_state, &state,
+						TIMER_IDLE, false,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			__timer_drain(base);
+			__timer_detach(base, timer);
+			return true;
+		}
+		if (state == TIMER_PENDING && !local &&
+		    __atomic_compare_exchange_n(&timer->_state, &state,
+						TIMER_CANCELLING, false,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			struct timer_base *owner = &cpus[timer->_cpu].timer;
+			timer->_cancel_next = __atomic_load_n(&owner->cancelled,
+							      __ATOMIC_RELAXED);
+			while (!__atomic_compare_exchange_n(
+				&owner->cancelled, &timer->_cancel_next, timer,
+				true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+				;
+			send_ipi(timer->_cpu, IPI_TIMER);
+			while (__atomic_load_n(&timer->_state,
+					       __ATOMIC_ACQUIRE) != TIMER_IDLE)
+				__timer_drain(base);
+			return true;
+		}
+		__timer_drain(base);
+	}
 }
 
 void set_cpu_on()
@@ -90,10 +311,8 @@ void set_cpu_on()
 
 	arch_reset_esr();
 	init_clock();
+	init_ipi();
 	cpus[cpuid()].online = true;
-	hello_timer[cpuid()].elapse = 5000;
-	hello_timer[cpuid()].handler = hello;
-	set_cpu_timer(&hello_timer[cpuid()]);
 }
 
 void set_cpu_off()
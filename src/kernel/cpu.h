@@ -1,21 +1,88 @@
 #pragma once
 
-#include <lib/rbtree.h>
+#include <lib/list.h>
 #include <proc/schinfo.h>
 #include <kernel/param.h>
 
+/*
+ * The timer wheel has TIMER_LVL_DEPTH levels of TIMER_LVL_SIZE buckets. The
+ * buckets of level `n` are TIMER_LVL_GRAN(n) ms apart, so that level 0 covers
+ * the next 64 ms exactly, and the last level about half an hour.
+ */
+#define TIMER_LVL_BITS 6
+#define TIMER_LVL_SIZE (1 << TIMER_LVL_BITS)
+#define TIMER_LVL_MASK (TIMER_LVL_SIZE - 1)
+#define TIMER_LVL_CLK_SHIFT 3
+#define TIMER_LVL_DEPTH 6
+#define TIMER_LVL_SHIFT(n) ((n) * TIMER_LVL_CLK_SHIFT)
+#define TIMER_LVL_GRAN(n) (1ull << TIMER_LVL_SHIFT(n))
+
+/*
+ * The states of a timer. Only the CPU it is set on moves it out of
+ * TIMER_PENDING, except that another CPU may ask it to cancel the timer.
+ */
+enum timer_state {
+	TIMER_IDLE,
+	TIMER_PENDING,
+	TIMER_RUNNING,
+	TIMER_CANCELLING,
+};
+
+/**
+ * timer - a one-shot timer that calls `handler` `elapse` ms after it is set.
+ *
+ * @triggered: whether the timer has fired since it was last set.
+ * @_state: an `enum timer_state`.
+ * @_key: when the timer is due, in ms.
+ * @_node: link the timer into its bucket.
+ * @_idx: the bucket, as level * TIMER_LVL_SIZE + index.
+ * @_cpu: the CPU the timer is set on.
+ * @_next: link the timer into the `incoming` list of `_cpu`.
+ * @_cancel_next: link the timer into the `cancelled` list of `_cpu`.
+ */
 struct timer {
 	bool triggered;
+	int _state;
 	int elapse;
 	u64 _key;
-	struct rb_node_ _node;
+	struct list_node _node;
+	int _idx;
+	int _cpu;
+	struct timer *_next;
+	struct timer *_cancel_next;
 	void (*handler)(struct timer *);
 	u64 data;
 };
 
+/**
+ * timer_base - the timer wheel of a CPU.
+ *
+ * Only its CPU touches the wheel, with interrupts off, so it needs no lock.
+ * Other CPUs hand their timers over through `incoming`, and the timers they
+ * cancel through `cancelled`.
+ *
+ * @clk: the next ms whose buckets have not been run yet.
+ * @next_expiry: when the first non-empty bucket is due, in ms. Cancelling a
+ * timer leaves it alone, so it may be early, never late.
+ * @programmed: when the clock interrupt is due, in ms.
+ * @pending: a bitmap of the non-empty buckets of each level.
+ * @vec: the buckets, level by level.
+ * @incoming: a lock-free stack of the timers set by other CPUs.
+ * @cancelled: a lock-free stack of the timers cancelled by other CPUs.
+ */
+struct timer_base {
+	u64 clk;
+	u64 next_expiry;
+	u64 programmed;
+	u64 pending[TIMER_LVL_DEPTH];
+	struct list_node vec[TIMER_LVL_DEPTH * TIMER_LVL_SIZE];
+	struct timer *incoming;
+	struct timer *cancelled;
+};
+
 struct cpu {
 	bool online;
-	struct rb_root_ timer;
+	struct timer_base timer;
 	struct sched sched;
 };
 
@@ -25,4 +92,5 @@ void set_cpu_on();
 void set_cpu_off();
 
 void set_cpu_timer(struct timer *timer);
-void cancel_cpu_timer(struct timer *timer);
+void set_cpu_timer_on(int cpu, struct timer *timer);
+bool cancel_cpu_timer(struct timer *timer);
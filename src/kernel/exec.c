@@ -11,10 +11,12 @@
 #include <proc/sched.h>
 #include <vm/vmregion.h>
 #include <vm/pgtbl.h>
+#include <vm/asid.h>
+#include <vm/mmap.h>
 #include <kernel/param.h>
 
 static int execve_load_section(struct vmspace *vms, Elf64_Phdr ph,
-			       struct inode *ip)
+			       struct file *f)
 {
 	u64 flags = 0;
 
@@ -27,6 +29,8 @@ static int execve_load_section(struct vmspace *vms, Elf64_Phdr ph,
 
 	struct vmregion *vmr =
 		create_vmregion(vms, flags, ph.p_vaddr, ph.p_memsz);
+	if (vmr == NULL)
+		return -1;
 
 	/**
      * ph.p_vaddr represents the starting address in the virtual memory
@@ -37,49 +41,17 @@ static int execve_load_section(struct vmspace *vms, Elf64_Phdr ph,
      * ph.p_filesz. The initial ph.p_filesz bytes in memory are filled with
      * the content from the ELF file. Any additional space, calculated as
      * (ph.p_memsz - ph.p_filesz), is initialized to zero.
+     *
+     * Nothing is loaded here. The region only records where its content
+     * comes from, and `pgfault_handler` reads in the pages that are actually
+     * touched. Pages beyond ph.p_filesz are zero-filled on demand.
      */
-
-	u64 begin = ph.p_vaddr;
-	u64 end = ph.p_vaddr + ph.p_filesz;
-
-	while (begin < end) {
-		// Allocate the physical page to be mapped.
-		void *page_to_map = (void *)kalloc_page();
-		if (page_to_map == NULL)
-			return -1;
-		memset(page_to_map, 0, PAGE_SIZE);
-
-		// begin is not guranteed to be page aligned.
-		u64 len = MIN(end - begin,
-			      (u64)PAGE_SIZE - (begin - PAGE_BASE(begin)));
-		u8 *dest =
-			(u8 *)((u64)page_to_map + (begin - PAGE_BASE(begin)));
-		usize offset = ph.p_offset + (begin - ph.p_vaddr);
-
-		// Copy the content from ELF to memory.
-		if (inodes.read(ip, dest, offset, len) < len)
-			return -1;
-
-		// Map the page in page table.
-		u64 pte_flags = PTE_USER_DATA;
-		if (vmr->flags & VMR_RO)
-			pte_flags |= PTE_RO;
-
-		map_in_pgtbl(vms->pgtbl, PAGE_BASE(begin), page_to_map,
-			     pte_flags);
-
-		begin += len;
-	}
-
-	// Fill the remaining space between ph.p_filesz and ph.p_memsz with zero.
-	if (begin % PAGE_SIZE != 0)
-		begin = PAGE_BASE(begin) + PAGE_SIZE;
-
-	while (begin < ph.p_vaddr + ph.p_memsz) {
-		map_in_pgtbl(vms->pgtbl, begin, get_zero_page(),
-			     PTE_USER_DATA | PTE_RO);
-		begin += PAGE_SIZE;
-	}
+	vmr->mmap_info.fp = file_dup(f);
+	vmr->mmap_info.offset = ph.p_offset;
+	vmr->mmap_info.filesz = ph.p_filesz;
+	vmr->mmap_info.prot = (flags & VMR_RO) ? PROT_READ | PROT_EXEC :
+						 PROT_READ | PROT_WRITE;
+	vmr->mmap_info.flags = MAP_PRIVATE;
 
 	return 0;
 }
@@ -87,9 +59,8 @@ static int execve_load_section(struct vmspace *vms, Elf64_Phdr ph,
 static int execve_alloc_heap(struct vmspace *vms)
 {
 	u64 heap_base = 0;
-	list_forall(p, vms->vmregions)
+	vmregion_forall(vms, vmr)
 	{
-		struct vmregion *vmr = container_of(p, struct vmregion, stnode);
 		if (vmr->end > heap_base)
 			heap_base = vmr->end;
 	}
@@ -97,88 +68,92 @@ static int execve_alloc_heap(struct vmspace *vms)
 	// There should be one protecting page for the heap.
 	heap_base = PAGE_BASE(heap_base) + 2 * PAGE_SIZE;
 
-	struct vmregion *vmr =
-		create_vmregion(vms, VMR_HEAP, heap_base, HEAP_SIZE);
-	if (vmr == NULL)
+	// The heap is zero-filled on demand.
+	if (create_vmregion(vms, VMR_HEAP, heap_base, HEAP_SIZE) == NULL)
 		return -1;
 
-	for (u64 i = heap_base; i < HEAP_SIZE; i += PAGE_SIZE)
-		map_in_pgtbl(vms->pgtbl, i, get_zero_page(),
-			     PTE_USER_DATA | PTE_RO);
-
 	return 0;
 }
 
 static int execve_alloc_stack(struct vmspace *vms)
 {
-	struct vmregion *vmr = create_vmregion(
-		vms, VMR_STACK, STACK_BASE - STACK_SIZE, STACK_SIZE);
-	if (vmr == NULL)
+	// The stack is zero-filled on demand. The pages holding the arguments are
+	// allocated by `copy_to_pgtbl`.
+	if (create_vmregion(vms, VMR_STACK, STACK_BASE - STACK_SIZE,
+			    STACK_SIZE) == NULL)
 		return -1;
 
-	for (u64 i = STACK_BASE - STACK_SIZE; i < STACK_BASE; i += PAGE_SIZE) {
-		if (i >= STACK_BASE - STACK_PAGES_INIT * PAGE_SIZE) {
-			void *ka = kalloc_page();
-			memset(ka, 0, PAGE_SIZE);
-			map_in_pgtbl(vms->pgtbl, i, ka, PTE_USER_DATA);
-		} else {
-			map_in_pgtbl(vms->pgtbl, i, get_zero_page(),
-				     PTE_USER_DATA | PTE_RO);
-		}
-	}
-
 	return 0;
 }
 
 int execve(const char *path, char *const argv[], char *const envp[])
 {
+	struct vmspace vms;
+	init_vmspace(&vms);
+
+	// Only the path lookup runs in a transaction. The content of the file is
+	// read in by page faults after execve returns.
 	struct op_ctx ctx;
 	bcache.begin_op(&ctx);
-
 	struct inode *ip = namei(path, &ctx);
+	bcache.end_op(&ctx);
 	if (!ip) {
+		destroy_vmspace(&vms);
+		return -1;
+	}
+
+	// The segments of the file are backed by this file object. Closing it puts
+	// the inode.
+	struct file *f = file_alloc();
+	if (f == NULL) {
+		bcache.begin_op(&ctx);
+		inodes.put(&ctx, ip);
 		bcache.end_op(&ctx);
+		destroy_vmspace(&vms);
 		return -1;
 	}
+	f->type = FD_INODE;
+	f->readable = true;
+	f->writable = false;
+	f->ip = ip;
+	f->off = 0;
 
+	// The lock of the inode is only held while the headers are read.
 	inodes.lock(ip);
 
 	// Read the elf header.
 	Elf64_Ehdr elf;
 	if (inodes.read(ip, (u8 *)&elf, 0, sizeof(Elf64_Ehdr)) <
 	    sizeof(Elf64_Ehdr))
-		goto bad;
+		goto bad_locked;
 
 	// Check the magic number.
 	if (strncmp((const char *)elf.e_ident, ELFMAG, strlen(ELFMAG)) != 0)
-		goto bad;
+		goto bad_locked;
 
 	// Read and parse program header.
-	struct vmspace vms;
-	init_vmspace(&vms);
-
-	Elf64_Half off = elf.e_phoff;
-	for (Elf64_Half i = 0; i < elf.e_phnum; i++) {
+	Elf64_Off off = elf.e_phoff;
+	for (Elf64_Half i = 0; i < elf.e_phnum;
+	     i++, off += sizeof(Elf64_Phdr)) {
 		// Read program header.
 		Elf64_Phdr ph;
 		if (inodes.read(ip, (u8 *)(&ph), off, sizeof(Elf64_Phdr)) <
 		    sizeof(Elf64_Phdr))
-			goto bad;
+			goto bad_locked;
 
 		if (ph.p_type != PT_LOAD)
 			continue;
 
 		ASSERT(ph.p_memsz >= ph.p_filesz);
 
-		if (execve_load_section(&vms, ph, ip) < 0)
-			goto bad;
-
-		off += sizeof(Elf64_Phdr);
+		if (execve_load_section(&vms, ph, f) < 0)
+			goto bad_locked;
 	}
 
 	inodes.unlock(ip);
-	inodes.put(&ctx, ip);
-	bcache.end_op(&ctx);
+
+	// The regions hold their own references to the file now.
+	file_close(f);
 
 	if (execve_alloc_heap(&vms) < 0)
 		goto bad;
@@ -200,8 +175,8 @@ int execve(const char *path, char *const argv[], char *const envp[])
 
 			if (sp < STACK_BASE - STACK_SIZE)
 				goto bad;
-			if (copy_to_user(vms.pgtbl, (void *)(sp), envp[envc],
-					 strlen(envp[envc]) + 1) < 0)
+			if (copy_to_pgtbl(vms.pgtbl, (void *)(sp), envp[envc],
+					  strlen(envp[envc]) + 1) < 0)
 				goto bad;
 			ustack_envp[envc] = (char *)sp;
 		}
@@ -223,8 +198,8 @@ int execve(const char *path, char *const argv[], char *const envp[])
 
 			if (sp < STACK_BASE - STACK_SIZE)
 				goto bad;
-			if (copy_to_user(vms.pgtbl, (void *)(sp), argv[argc],
-					 strlen(argv[argc]) + 1) < 0)
+			if (copy_to_pgtbl(vms.pgtbl, (void *)(sp), argv[argc],
+					  strlen(argv[argc]) + 1) < 0)
 				goto bad;
 			ustack_argv[argc] = (char *)sp;
 		}
@@ -234,13 +209,13 @@ int execve(const char *path, char *const argv[], char *const envp[])
 	sp -= sp % 16;
 
 	sp -= (envc + 1) * sizeof(char *);
-	if (copy_to_user(vms.pgtbl, (void *)sp, &ustack_envp,
-			 (envc + 1) * sizeof(char *)) < 0)
+	if (copy_to_pgtbl(vms.pgtbl, (void *)sp, &ustack_envp,
+			  (envc + 1) * sizeof(char *)) < 0)
 		goto bad;
 
 	sp -= (argc + 1) * sizeof(char *);
-	if (copy_to_user(vms.pgtbl, (void *)sp, &ustack_argv,
-			 (argc + 1) * sizeof(char *)) < 0)
+	if (copy_to_pgtbl(vms.pgtbl, (void *)sp, &ustack_argv,
+			  (argc + 1) * sizeof(char *)) < 0)
 		goto bad;
 
 	/**
@@ -257,25 +232,30 @@ int execve(const char *path, char *const argv[], char *const envp[])
      */
 
 	sp -= 8;
-	if (copy_to_user(vms.pgtbl, (void *)sp, &argc, sizeof(int)) < 0)
+	if (copy_to_pgtbl(vms.pgtbl, (void *)sp, &argc, sizeof(int)) < 0)
 		goto bad;
 
 	thisproc()->ucontext->sp = sp;
 	thisproc()->ucontext->elr = elf.e_entry;
 
-	copy_vmregions(&vms, &thisproc()->vmspace);
-	free_page_table(&thisproc()->vmspace.pgtbl);
-	thisproc()->vmspace.pgtbl = vms.pgtbl;
-
-	set_page_table(thisproc()->vmspace.pgtbl);
+	// Switch to the new address space and release the old one. The old one is
+	// detached from the process first, because releasing it may sleep.
+	struct proc *p = thisproc();
+	struct vmspace old = p->vmspace;
+	p->vmspace = vms;
+	switch_vmspace(&p->vmspace);
+	if (p->vfork_parent) {
+		vfork_release(p, &old);
+	} else {
+		mmap_sync_all(&old);
+		destroy_vmspace(&old);
+	}
 
 	return argc;
+bad_locked:
+	inodes.unlock(ip);
+	file_close(f);
 bad:
 	destroy_vmspace(&vms);
-	if (ip) {
-		inodes.unlock(ip);
-		inodes.put(&ctx, ip);
-		bcache.end_op(&ctx);
-	}
 	return -1;
-}
\ No newline at end of file
+}
@@ -34,6 +34,21 @@ static struct page page_info[MAX_PAGES];
 /* The queue for all pages available. It is placed in BSS segment. */
 static struct list pages_free;
 
+/*
+ * The queue for huge pages, which are 2 MiB of contiguous memory at the top of
+ * the memory. They are set aside at boot, since the free pages soon lose all
+ * contiguity. The pages of a huge page that has been split are freed one by
+ * one, and the huge page goes back to the queue once all of them are free.
+ */
+static struct list huge_pages_free;
+
+/* The start of the memory for huge pages. */
+static u64 huge_base;
+
+/* The number of free pages of each split huge page. Protected by the lock of
+ * huge_pages_free. */
+static int huge_pieces_free[HUGE_PAGES];
+
 /* The hash map for pages with different maximum sizes of available area. */
 static struct list slabs[SLAB_MAX_ORDER + 1];
 
@@ -54,12 +69,19 @@ define_early_init(pages)
 	init_rc(&alloc_page_cnt);
 	/* Initialize the list for free pages. */
 	list_init(&pages_free);
+	list_init(&huge_pages_free);
 	/* The number of pages under track. */
 	u64 inited_pages = 0;
+	huge_base = (P2K(PHYSTOP) - HUGE_PAGES * HUGE_PAGE_SIZE) &
+			~(u64)(HUGE_PAGE_SIZE - 1);
 
 	for (u64 p = PAGE_BASE((u64)&end) + PAGE_SIZE; p < P2K(PHYSTOP);
 	     p += PAGE_SIZE) {
-		list_push_back(&pages_free, (ListNode *)p);
+		/* Pages set aside for huge pages count as allocated. */
+		if (p < huge_base)
+			list_push_back(&pages_free, (ListNode *)p);
+		else
+			increment_rc(&alloc_page_cnt);
 
 		if (inited_pages >= MAX_PAGES)
 			PANIC();
@@ -75,6 +97,9 @@ define_early_init(pages)
 		inited_pages++;
 	}
 
+	for (u64 p = huge_base; p < P2K(PHYSTOP); p += HUGE_PAGE_SIZE)
+		list_push_back(&huge_pages_free, (ListNode *)p);
+
 	/* Initialize the slab lists */
 	for (int i = 0; i < SLAB_MAX_ORDER + 1; i++)
 		list_init(&slabs[i]);
@@ -84,6 +109,10 @@ define_init(zero_page)
 {
 	zero = (void *)kalloc_page();
 	memset(zero, 0, PAGE_SIZE);
+
+	/* The zero page is mapped and unmapped like any other page, but it must
+	 * never be freed. Hold a reference to it forever. */
+	share_page(zero);
 }
 
 void *kalloc_page()
@@ -98,12 +127,44 @@ void *kalloc_page()
 
 void kfree_page(void *p)
 {
+	/* A page of a split huge page waits for the rest of it. */
+	if ((u64)p >= huge_base) {
+		u64 i = ((u64)p - huge_base) / HUGE_PAGE_SIZE;
+		ASSERT(i < HUGE_PAGES);
+		list_lock(&huge_pages_free);
+		if (++huge_pieces_free[i] == HUGE_PAGE_SIZE / PAGE_SIZE) {
+			huge_pieces_free[i] = 0;
+			list_push_back(&huge_pages_free,
+				       (ListNode *)(huge_base + i * HUGE_PAGE_SIZE));
+		}
+		list_unlock(&huge_pages_free);
+		return;
+	}
+
 	decrement_rc(&alloc_page_cnt);
 	list_lock(&pages_free);
 	list_push_back(&pages_free, (ListNode *)p);
 	list_unlock(&pages_free);
 }
 
+/* Allocate a huge page, or return NULL if there is none left. */
+void *kalloc_huge_page()
+{
+	list_lock(&huge_pages_free);
+	void *page = (void *)huge_pages_free.head;
+	if (page)
+		list_pop_head(&huge_pages_free);
+	list_unlock(&huge_pages_free);
+	return page;
+}
+
+void kfree_huge_page(void *p)
+{
+	list_lock(&huge_pages_free);
+	list_push_back(&huge_pages_free, (ListNode *)p);
+	list_unlock(&huge_pages_free);
+}
+
 void *kalloc(isize s)
 {
 	ASSERT(s > 0 && s <= PAGE_SIZE);
@@ -244,4 +305,30 @@ struct page *get_page_info_by_kaddr(void *kaddr)
 		return NULL;
 	}
 	return &page_info[id];
-}
\ No newline at end of file
+}
+/* Take a reference to the page at `kaddr`. */
+void *share_page(void *kaddr)
+{
+	struct page *page = get_page_info_by_kaddr(kaddr);
+	if (page)
+		increment_rc(&page->ref);
+	return kaddr;
+}
+
+/* Drop a reference to the page at `kaddr`. The page is freed when the last
+ * reference is gone. */
+void put_page(void *kaddr)
+{
+	struct page *page = get_page_info_by_kaddr(kaddr);
+	if (page && decrement_rc(&page->ref))
+		kfree_page(kaddr);
+}
+
+/* Drop a reference to the huge page at `kaddr`, which is counted in the
+ * information of its first page. */
+void put_huge_page(void *kaddr)
+{
+	struct page *page = get_page_info_by_kaddr(kaddr);
+	if (page && decrement_rc(&page->ref))
+		kfree_huge_page(kaddr);
+}
@@ -33,6 +33,11 @@ u64 __alloc_partition(Page *p);
 PartitionedNode *__partition_page(u32 rounded_size, u8 bucket_index);
 WARN_RESULT void *kalloc_page(void);
 void kfree_page(void *page);
+WARN_RESULT void *kalloc_huge_page(void);
+void kfree_huge_page(void *page);
+void put_huge_page(void *kaddr);
 WARN_RESULT void *kalloc(isize size);
 void kfree(void *ptr);
 struct page *get_page_info_by_kaddr(void *kaddr);
+void *share_page(void *kaddr);
+void put_page(void *kaddr);
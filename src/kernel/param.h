@@ -4,11 +4,15 @@
 #define STACK_SIZE 8 * 4096
 #define HEAP_SIZE 8 * 4096
 #define STACK_BASE 0x0000ffff00000000
-#define STACK_PAGES_INIT 80
 #define MAX_ARG 32
 #define MAX_ENV 128
 #define SLAB_MAX_ORDER 11
 #define NR_SYSCALL 512
 #define SLICE_LEN 1
+#define SCHED_LATENCY 6
+#define RR_SLICE_LEN 10
+#define BALANCE_INTERVAL 16
 #define PID_POOL_SIZE 1 << 20
-#define MMAP_LAZY
\ No newline at end of file
+#define MMAP_LAZY
+#define MMAP_BASE 0x0000001000000000
+#define HUGE_PAGES 16
@@ -16,4 +16,5 @@
 #define SYS_myexit 457
 #define SYS_myyield 459
 #define SYS_myreport 499
-#define SYS_pstat 500
\ No newline at end of file
+#define SYS_pstat 500
+#define SYS_schedstat 501
\ No newline at end of file
@@ -15,6 +15,7 @@
 #include <sys/syscall.h>
 #include <vm/vmregion.h>
 #include <vm/mmap.h>
+#include <vm/uaccess.h>
 
 extern struct inode_tree inodes;
 extern struct block_cache bcache;
@@ -67,6 +68,13 @@ define_syscall(munmap, void *addr, usize length)
 	return munmap(addr, length);
 }
 
+define_syscall(msync, void *addr, usize length, int flags)
+{
+	// Dirty pages are always written synchronously.
+	(void)flags;
+	return msync(addr, length);
+}
+
 /* Get the parameters and call filedup. */
 define_syscall(dup, int fd)
 {
@@ -84,7 +92,7 @@ define_syscall(dup, int fd)
 define_syscall(read, int fd, char *buffer, int size)
 {
 	struct file *f = fd2file(fd);
-	if (!f || size <= 0 || !user_writeable(buffer, size))
+	if (!f || size <= 0 || !access_ok(buffer, size))
 		return -1;
 	return file_read(f, buffer, size);
 }
@@ -93,7 +101,7 @@ define_syscall(read, int fd, char *buffer, int size)
 define_syscall(write, int fd, char *buffer, int size)
 {
 	struct file *f = fd2file(fd);
-	if (!f || size <= 0 || !user_readable(buffer, size))
+	if (!f || size <= 0 || !access_ok(buffer, size))
 		return -1;
 	return file_write(f, buffer, size);
 }
@@ -101,15 +109,15 @@ define_syscall(write, int fd, char *buffer, int size)
 define_syscall(writev, int fd, struct iovec *iov, int iovcnt)
 {
 	struct file *f = fd2file(fd);
-	struct iovec *p;
-	if (!f || iovcnt <= 0 ||
-	    !user_readable(iov, sizeof(struct iovec) * iovcnt))
+	struct iovec v;
+	if (!f || iovcnt <= 0)
 		return -1;
 	usize tot = 0;
-	for (p = iov; p < iov + iovcnt; p++) {
-		if (!user_readable(p->iov_base, p->iov_len))
+	for (struct iovec *p = iov; p < iov + iovcnt; p++) {
+		if (copy_from_user(&v, p, sizeof(v)) < 0 ||
+		    !access_ok(v.iov_base, v.iov_len))
 			return -1;
-		tot += file_write(f, p->iov_base, p->iov_len);
+		tot += file_write(f, v.iov_base, v.iov_len);
 	}
 	return tot;
 }
@@ -129,15 +137,17 @@ define_syscall(close, int fd)
 define_syscall(fstat, int fd, struct stat *st)
 {
 	struct file *f = fd2file(fd);
-	if (!f || !user_writeable(st, sizeof(*st)))
+	struct stat kst;
+	if (!f || file_stat(f, &kst) < 0)
 		return -1;
-	return file_stat(f, st);
+	return copy_to_user(st, &kst, sizeof(kst));
 }
 
 define_syscall(newfstatat, int dirfd, const char *path, struct stat *st,
 	       int flags)
 {
-	if (!user_strlen(path, 256) || !user_writeable(st, sizeof(*st)))
+	struct stat kst;
+	if (!user_strlen(path, 256))
 		return -1;
 	if (dirfd != AT_FDCWD) {
 		printk("sys_fstatat: dirfd unimplemented\n");
@@ -156,12 +166,12 @@ define_syscall(newfstatat, int dirfd, const char *path, struct stat *st,
 		return -1;
 	}
 	inodes.lock(ip);
-	stati(ip, st);
+	stati(ip, &kst);
 	inodes.unlock(ip);
 	inodes.put(&ctx, ip);
 	bcache.end_op(&ctx);
 
-	return 0;
+	return copy_to_user(st, &kst, sizeof(kst));
 }
 
 /* If the directory dp is empty except for "." and ".." */
@@ -449,21 +459,24 @@ define_syscall(chdir, const char *path)
 	return 0;
 }
 
-define_syscall(pipe2, int *fd, int flags)
+define_syscall(pipe2, int *pipefd, int flags)
 {
 	(void)flags;
 	struct file *f0;
 	struct file *f1;
+	int fd[2];
 
 	if (pipe_alloc(&f0, &f1) < 0)
 		return -1;
 
 	fd[0] = fdalloc(f0);
-	fd[1] = fdalloc(f1);
+	fd[1] = fd[0] < 0 ? -1 : fdalloc(f1);
 
-	if (fd[0] < 0 || fd[1] < 0) {
+	if (fd[1] < 0 || copy_to_user(pipefd, fd, sizeof(fd)) < 0) {
 		if (fd[0] >= 0)
 			thisproc()->oftable.ofiles[fd[0]] = NULL;
+		if (fd[1] >= 0)
+			thisproc()->oftable.ofiles[fd[1]] = NULL;
 		file_close(f0);
 		file_close(f1);
 		return -1;
@@ -471,3 +484,46 @@ define_syscall(pipe2, int *fd, int flags)
 
 	return 0;
 }
+
+/*
+ * Move data between a pipe and a file without copying it through user
+ * memory. An offset pointer, if given, is used and updated instead of the
+ * offset of the file. `flags` is ignored.
+ */
+define_syscall(splice, int fd_in, i64 *off_in, int fd_out, i64 *off_out,
+	       usize len, unsigned int flags)
+{
+	(void)flags;
+	struct file *fin = fd2file(fd_in);
+	struct file *fout = fd2file(fd_out);
+	struct file *f;
+	i64 *offp;
+	usize off;
+	isize r;
+
+	if (!fin || !fout || !fin->readable || !fout->writable)
+		return -1;
+	if (fin->type == FD_PIPE && fout->type == FD_INODE && !off_in)
+		f = fout, offp = off_out;
+	else if (fin->type == FD_INODE && fout->type == FD_PIPE && !off_out)
+		f = fin, offp = off_in;
+	else
+		return -1;
+
+	off = f->off;
+	if (offp && copy_from_user(&off, offp, sizeof(off)) < 0)
+		return -1;
+
+	if (f == fin)
+		r = splice_to_pipe(fout->pipe, fin->ip, &off, len);
+	else
+		r = splice_from_pipe(fin->pipe, fout->ip, &off, len);
+
+	if (r > 0) {
+		if (!offp)
+			f->off = off;
+		else if (copy_to_user(offp, &off, sizeof(off)) < 0)
+			return -1;
+	}
+	return r;
+}
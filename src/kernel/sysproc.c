@@ -1,8 +1,11 @@
+#include <driver/clock.h>
 #include <kernel/mem.h>
 #include <kernel/syscall.h>
 #include <lib/printk.h>
 #include <proc/proc.h>
 #include <proc/sched.h>
+#include <proc/schedstat.h>
+#include <vm/uaccess.h>
 #include <vm/vmregion.h>
 
 int execve(const char *path, char *const argv[], char *const envp[]);
@@ -39,6 +42,150 @@ define_syscall(myyield)
 	return 0;
 }
 
+#define PRIO_PROCESS 0
+
+define_syscall(setpriority, int which, int who, int prio)
+{
+	if (which != PRIO_PROCESS)
+		return -1;
+	return set_nice(who, prio);
+}
+
+/*
+ * Like Linux, return 20 - nice rather than the nice value, so that the result
+ * is never negative. The C library converts it back.
+ */
+define_syscall(getpriority, int which, int who)
+{
+	int nice;
+	if (which != PRIO_PROCESS || get_nice(who, &nice) < 0)
+		return -1;
+	return 20 - nice;
+}
+
+/* CPU masks are a single word, as NCPU is small. */
+define_syscall(sched_setaffinity, int pid, usize len, u64 *mask)
+{
+	u64 m = 0;
+	if (copy_from_user(&m, mask, MIN(len, sizeof(m))) < 0)
+		return -1;
+	return set_affinity(pid, m);
+}
+
+define_syscall(sched_getaffinity, int pid, usize len, u64 *mask)
+{
+	u64 m;
+	if (len < sizeof(m) || get_affinity(pid, &m) < 0 ||
+	    copy_to_user(mask, &m, sizeof(m)) < 0)
+		return -1;
+	return sizeof(m);
+}
+
+/* The part of `struct sched_param` that the kernel looks at. */
+struct sched_param {
+	int sched_priority;
+};
+
+define_syscall(sched_setscheduler, int pid, int policy,
+	       struct sched_param *param)
+{
+	struct sched_param sp;
+	if (copy_from_user(&sp, param, sizeof(sp)) < 0)
+		return -1;
+	return set_policy(pid, policy, sp.sched_priority);
+}
+
+define_syscall(sched_getscheduler, int pid)
+{
+	int policy, prio;
+	if (get_policy(pid, &policy, &prio) < 0)
+		return -1;
+	return policy;
+}
+
+define_syscall(sched_getparam, int pid, struct sched_param *param)
+{
+	struct sched_param sp;
+	int policy;
+	if (get_policy(pid, &policy, &sp.sched_priority) < 0 ||
+	    copy_to_user(param, &sp, sizeof(sp)) < 0)
+		return -1;
+	return 0;
+}
+
+define_syscall(schedstat, int cpu, struct schedstat *buf)
+{
+	struct schedstat st;
+	if (cpu < 0 || cpu >= NCPU)
+		return -1;
+	get_schedstat(cpu, &st);
+	return copy_to_user(buf, &st, sizeof(st)) < 0 ? -1 : 0;
+}
+
+/* `struct timespec` comes with <sys/stat.h>, but the clocks do not. */
+#define CLOCK_REALTIME 0
+#define CLOCK_MONOTONIC 1
+#define TIMER_ABSTIME 1
+
+/* Read a timespec from the user, in us rounded up. Returns -1 if invalid. */
+static i64 timespec_to_us(const struct timespec *uts)
+{
+	struct timespec ts;
+	if (copy_from_user(&ts, uts, sizeof(ts)) < 0 || ts.tv_sec < 0 ||
+	    ts.tv_nsec < 0 || ts.tv_nsec >= 1000000000)
+		return -1;
+	return MIN((i64)ts.tv_sec, 1ll << 40) * 1000000 +
+	       (ts.tv_nsec + 999) / 1000;
+}
+
+/*
+ * Sleep until `deadline`, in us since boot, off the run queue. The process
+ * waits on a semaphore that nobody posts, so only the timeout, or a kill,
+ * wakes it up. Returns 0 when the deadline is reached, or -1 with the time
+ * left in `rem` if the sleep is cut short.
+ */
+static int sleep_until(u64 deadline, struct timespec *rem)
+{
+	Semaphore sem;
+	u64 now;
+
+	init_sem(&sem, 0);
+	while ((now = get_timestamp_us()) < deadline && !thisproc()->killed) {
+		bool r = wait_sem_timeout(&sem, (deadline - now) / 1000 + 1);
+		(void)r;
+	}
+	if (now >= deadline)
+		return 0;
+	if (rem) {
+		struct timespec ts = { .tv_sec = (deadline - now) / 1000000,
+				       .tv_nsec = (deadline - now) % 1000000 *
+						  1000 };
+		if (copy_to_user(rem, &ts, sizeof(ts)) < 0)
+			return -1;
+	}
+	return -1;
+}
+
+define_syscall(nanosleep, const struct timespec *req, struct timespec *rem)
+{
+	i64 us = timespec_to_us(req);
+	if (us < 0)
+		return -1;
+	return sleep_until(get_timestamp_us() + us, rem);
+}
+
+/* Both clocks count from boot, as there is no real-time clock. */
+define_syscall(clock_nanosleep, int clock, int flags,
+	       const struct timespec *req, struct timespec *rem)
+{
+	i64 us = timespec_to_us(req);
+	if ((clock != CLOCK_REALTIME && clock != CLOCK_MONOTONIC) || us < 0)
+		return -1;
+	if (flags & TIMER_ABSTIME)
+		return sleep_until(us, NULL);
+	return sleep_until(get_timestamp_us() + us, rem);
+}
+
 define_syscall(pstat)
 {
 	return (u64)left_page_cnt();
@@ -49,11 +196,18 @@ define_syscall(sbrk, i64 size)
 	return sbrk(size);
 }
 
+#define SIGCHLD 17
+#define CLONE_VM 0x100
+#define CLONE_VFORK 0x4000
+
 define_syscall(clone, int flag, void *childstk)
 {
 	(void)childstk;
-	if (flag != 17) {
-		printk("sys_clone: flags other than SIGCHLD are not supported.\n");
+	if (flag == (SIGCHLD | CLONE_VM | CLONE_VFORK))
+		return vfork();
+	if (flag != SIGCHLD) {
+		printk("sys_clone: flags other than SIGCHLD and vfork are not "
+		       "supported.\n");
 		return -1;
 	}
 	return fork();
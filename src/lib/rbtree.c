@@ -51,7 +51,14 @@ static inline void __rb_rotate_set_parents(rb_node old, rb_node new,
 	__rb_change_child(old, new, parent, root);
 }
 
-static void __rb_insert_fix(rb_node node, rb_root root)
+/* Recompute the augmented data of `node` if the tree is augmented. */
+static inline void __rb_augment(rb_augment aug, rb_node node)
+{
+	if (aug)
+		aug(node);
+}
+
+static void __rb_insert_fix(rb_node node, rb_root root, rb_augment aug)
 {
 	rb_node parent = rb_red_parent(node), gparent, tmp;
 	while (1) {
@@ -84,6 +91,8 @@ static void __rb_insert_fix(rb_node node, rb_root root)
 							    RB_BLACK);
 				node->rb_left = parent;
 				rb_set_parent_color(parent, node, RB_RED);
+				__rb_augment(aug, parent);
+				__rb_augment(aug, node);
 				parent = node;
 				tmp = node->rb_right;
 			}
@@ -93,6 +102,8 @@ static void __rb_insert_fix(rb_node node, rb_root root)
 				rb_set_parent_color(tmp, gparent, RB_BLACK);
 			parent->rb_right = gparent;
 			__rb_rotate_set_parents(gparent, parent, root, RB_RED);
+			__rb_augment(aug, gparent);
+			__rb_augment(aug, parent);
 			break;
 		} else {
 			tmp = gparent->rb_left;
@@ -115,6 +126,8 @@ static void __rb_insert_fix(rb_node node, rb_root root)
 							    RB_BLACK);
 				node->rb_right = parent;
 				rb_set_parent_color(parent, node, RB_RED);
+				__rb_augment(aug, parent);
+				__rb_augment(aug, node);
 				parent = node;
 				tmp = node->rb_left;
 			}
@@ -124,12 +137,18 @@ static void __rb_insert_fix(rb_node node, rb_root root)
 				rb_set_parent_color(tmp, gparent, RB_BLACK);
 			parent->rb_left = gparent;
 			__rb_rotate_set_parents(gparent, parent, root, RB_RED);
+			__rb_augment(aug, gparent);
+			__rb_augment(aug, parent);
 			break;
 		}
 	}
 }
 
-static rb_node __rb_erase(rb_node node, rb_root root)
+/*
+ * Unlink `node` from the tree. The lowest node whose subtree has changed is
+ * returned in `changed`.
+ */
+static rb_node __rb_erase(rb_node node, rb_root root, rb_node *changed)
 {
 	rb_node child = node->rb_right, tmp = node->rb_left;
 	rb_node parent, rebalance;
@@ -143,11 +162,13 @@ static rb_node __rb_erase(rb_node node, rb_root root)
 			rebalance = NULL;
 		} else
 			rebalance = __rb_is_black(pc) ? parent : NULL;
+		*changed = parent;
 	} else if (!child) {
 		tmp->__rb_parent_color = pc = node->__rb_parent_color;
 		parent = __rb_parent(pc);
 		__rb_change_child(node, tmp, parent, root);
 		rebalance = NULL;
+		*changed = parent;
 	} else {
 		rb_node successor = child, child2;
 		tmp = child->rb_left;
@@ -178,11 +199,13 @@ static rb_node __rb_erase(rb_node node, rb_root root)
 			successor->__rb_parent_color = pc;
 			rebalance = __rb_is_black(pc2) ? parent : NULL;
 		}
+		// The successor is an ancestor of its old parent now.
+		*changed = parent;
 	}
 	return rebalance;
 }
 
-static void __rb_erase_fix(rb_node parent, rb_root root)
+static void __rb_erase_fix(rb_node parent, rb_root root, rb_augment aug)
 {
 	rb_node node = NULL, sibling, tmp1, tmp2;
 	while (1) {
@@ -194,6 +217,8 @@ static void __rb_erase_fix(rb_node parent, rb_root root)
 				sibling->rb_left = parent;
 				__rb_rotate_set_parents(parent, sibling, root,
 							RB_RED);
+				__rb_augment(aug, parent);
+				__rb_augment(aug, sibling);
 				sibling = tmp1;
 			}
 			tmp1 = sibling->rb_right;
@@ -224,6 +249,8 @@ static void __rb_erase_fix(rb_node parent, rb_root root)
 					parent->rb_right = tmp2;
 					tmp1 = sibling;
 					sibling = tmp2;
+					__rb_augment(aug, tmp1);
+					__rb_augment(aug, sibling);
 				}
 			}
 			parent->rb_right = tmp2 = sibling->rb_left;
@@ -233,6 +260,8 @@ static void __rb_erase_fix(rb_node parent, rb_root root)
 			rb_set_parent_color(tmp1, sibling, RB_BLACK);
 			__rb_rotate_set_parents(parent, sibling, root,
 						RB_BLACK);
+			__rb_augment(aug, parent);
+			__rb_augment(aug, sibling);
 			break;
 		} else {
 			sibling = parent->rb_left;
@@ -242,6 +271,8 @@ static void __rb_erase_fix(rb_node parent, rb_root root)
 				sibling->rb_right = parent;
 				__rb_rotate_set_parents(parent, sibling, root,
 							RB_RED);
+				__rb_augment(aug, parent);
+				__rb_augment(aug, sibling);
 				sibling = tmp1;
 			}
 			tmp1 = sibling->rb_left;
@@ -272,6 +303,8 @@ static void __rb_erase_fix(rb_node parent, rb_root root)
 					parent->rb_left = tmp2;
 					tmp1 = sibling;
 					sibling = tmp2;
+					__rb_augment(aug, tmp1);
+					__rb_augment(aug, sibling);
 				}
 			}
 			parent->rb_left = tmp2 = sibling->rb_right;
@@ -281,6 +314,8 @@ static void __rb_erase_fix(rb_node parent, rb_root root)
 			rb_set_parent_color(tmp1, sibling, RB_BLACK);
 			__rb_rotate_set_parents(parent, sibling, root,
 						RB_BLACK);
+			__rb_augment(aug, parent);
+			__rb_augment(aug, sibling);
 			break;
 		}
 	}
@@ -288,6 +323,18 @@ static void __rb_erase_fix(rb_node parent, rb_root root)
 
 int _rb_insert(rb_node node, rb_root rt,
 	       bool (*cmp)(rb_node lnode, rb_node rnode))
+{
+	return _rb_insert_augmented(node, rt, cmp, NULL);
+}
+
+/*
+ * Insert `node` into a tree whose nodes carry data computed from their
+ * subtrees, such as an interval tree. `aug` recomputes the data of a node from
+ * its children, and it is called on every node whose subtree changes.
+ */
+int _rb_insert_augmented(rb_node node, rb_root rt,
+			 bool (*cmp)(rb_node lnode, rb_node rnode),
+			 rb_augment aug)
 {
 	rb_node nw = rt->rb_node, parent = NULL;
 	node->rb_left = node->rb_right = NULL;
@@ -310,16 +357,36 @@ int _rb_insert(rb_node node, rb_root rt,
 			return -1;
 		}
 	}
-	__rb_insert_fix(node, rt);
+	if (aug)
+		_rb_propagate(node, aug);
+	__rb_insert_fix(node, rt, aug);
 	return 0;
 }
 
 void _rb_erase(rb_node node, rb_root root)
 {
-	rb_node rebalance;
-	rebalance = __rb_erase(node, root);
+	_rb_erase_augmented(node, root, NULL);
+}
+
+/* Erase `node` from a tree augmented by `aug`. See `_rb_insert_augmented`. */
+void _rb_erase_augmented(rb_node node, rb_root root, rb_augment aug)
+{
+	rb_node rebalance, changed;
+	rebalance = __rb_erase(node, root, &changed);
+	if (aug)
+		_rb_propagate(changed, aug);
 	if (rebalance)
-		__rb_erase_fix(rebalance, root);
+		__rb_erase_fix(rebalance, root, aug);
+}
+
+/*
+ * Recompute the augmented data of `node` and all its ancestors, e.g. after the
+ * data of `node` itself has changed.
+ */
+void _rb_propagate(rb_node node, rb_augment aug)
+{
+	for (; node; node = rb_parent(node))
+		aug(node);
 }
 
 rb_node _rb_lookup(rb_node node, rb_root rt,
@@ -347,6 +414,23 @@ rb_node _rb_first(rb_root rt)
 	return n;
 }
 
+/* Get the node after `node` in order, or NULL if `node` is the last. */
+rb_node _rb_next(rb_node node)
+{
+	rb_node parent;
+
+	if (node->rb_right) {
+		node = node->rb_right;
+		while (node->rb_left)
+			node = node->rb_left;
+		return node;
+	}
+
+	while ((parent = rb_parent(node)) && node == parent->rb_right)
+		node = parent;
+	return parent;
+}
+
 void rbtree_init(RBTree *rbtree)
 {
 	init_spinlock(&rbtree->rblock);
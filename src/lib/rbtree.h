@@ -16,12 +16,19 @@ struct rb_root_ {
 };
 
 typedef struct rb_root_ *rb_root;
+typedef void (*rb_augment)(rb_node node);
 WARN_RESULT int _rb_insert(rb_node node, rb_root root,
 			   bool (*cmp)(rb_node lnode, rb_node rnode));
+WARN_RESULT int _rb_insert_augmented(rb_node node, rb_root root,
+				     bool (*cmp)(rb_node lnode, rb_node rnode),
+				     rb_augment aug);
 void _rb_erase(rb_node node, rb_root root);
+void _rb_erase_augmented(rb_node node, rb_root root, rb_augment aug);
+void _rb_propagate(rb_node node, rb_augment aug);
 rb_node _rb_lookup(rb_node node, rb_root rt,
 		   bool (*cmp)(rb_node lnode, rb_node rnode));
 rb_node _rb_first(rb_root root);
+rb_node _rb_next(rb_node node);
 
 typedef struct {
 	struct rb_root_ _root;
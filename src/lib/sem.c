@@ -1,5 +1,5 @@
 #include <lib/sem.h>
-#include <kernel/mem.h>
+#include <kernel/cpu.h>
 #include <proc/sched.h>
 #include <lib/printk.h>
 
@@ -64,22 +64,55 @@ bool _wait_sem(Semaphore *sem, bool alertable)
 		release_spinlock(&sem->lock);
 		return true;
 	}
-	WaitData *wait = kalloc(sizeof(WaitData));
-	wait->proc = thisproc();
-	wait->up = false;
-	_insert_into_list(&sem->sleeplist, &wait->slnode);
-	schedule(RUNNABLE);
+	// The wait record lives on our stack: `_post_sem` only touches it with the
+	// lock held, and we take the lock again before returning.
+	WaitData wait = { .up = false, .proc = thisproc() };
+	_insert_into_list(&sem->sleeplist, &wait.slnode);
+	schedule_unlock(alertable ? SLEEPING : DEEPSLEEPING, &sem->lock);
+	acquire_spinlock(&sem->lock);
+	if (!wait.up) {
+		ASSERT(++sem->val <= 0);
+		_detach_from_list(&wait.slnode);
+	}
 	release_spinlock(&sem->lock);
-	schedule(alertable ? SLEEPING : DEEPSLEEPING);
+	return wait.up;
+}
+
+static void __sem_timeout_handler(struct timer *t)
+{
+	activate_proc((struct proc *)t->data);
+}
+
+/*
+ * Like an alertable `_wait_sem`, but give up after `timeout` ms. The timer is
+ * set on this CPU, whose interrupts are off until the process sleeps, so it
+ * cannot fire too early to wake the process. Returns false if the wait timed
+ * out or was alerted.
+ */
+bool _wait_sem_timeout(Semaphore *sem, u64 timeout)
+{
+	if (--sem->val >= 0) {
+		release_spinlock(&sem->lock);
+		return true;
+	}
+	struct timer timer = {
+		.elapse = MIN(timeout, (u64)0x7fffffff),
+		.handler = __sem_timeout_handler,
+		.data = (u64)thisproc(),
+	};
+	WaitData wait = { .up = false, .proc = thisproc() };
+	_insert_into_list(&sem->sleeplist, &wait.slnode);
+	set_cpu_timer(&timer);
+	schedule_unlock(SLEEPING, &sem->lock);
+	// We may wake up on another CPU. The timer is cancelled wherever it is.
+	cancel_cpu_timer(&timer);
 	acquire_spinlock(&sem->lock);
-	if (!wait->up) {
+	if (!wait.up) {
 		ASSERT(++sem->val <= 0);
-		_detach_from_list(&wait->slnode);
+		_detach_from_list(&wait.slnode);
 	}
 	release_spinlock(&sem->lock);
-	bool ret = wait->up;
-	kfree(wait);
-	return ret;
+	return wait.up;
 }
 
 void _post_sem(Semaphore *sem)
@@ -19,6 +19,9 @@
 #define unalertable_wait_sem(sem) \
 	ASSERT((_lock_sem(sem), _wait_sem(sem, false)))
 
+#define wait_sem_timeout(sem, timeout) \
+	(_lock_sem(sem), _wait_sem_timeout(sem, timeout))
+
 #define post_sem(sem) (_lock_sem(sem), _post_sem(sem), _unlock_sem(sem))
 
 #define get_sem(sem)                        \
@@ -66,4 +69,5 @@ WARN_RESULT int _query_sem(Semaphore *);
 void _lock_sem(Semaphore *);
 void _unlock_sem(Semaphore *);
 WARN_RESULT bool _wait_sem(Semaphore *, bool alertable);
+WARN_RESULT bool _wait_sem_timeout(Semaphore *, u64 timeout);
 void _post_sem(Semaphore *);
@@ -11,5 +11,6 @@ struct spinlock {
 typedef struct spinlock SpinLock;
 
 void init_spinlock(struct spinlock *);
+WARN_RESULT bool __try_acquire_spinlock(struct spinlock *);
 void acquire_spinlock(struct spinlock *);
 void release_spinlock(struct spinlock *);
@@ -1,18 +1,102 @@
+#include <aarch64/intrinsic.h>
 #include <lib/string.h>
 
+/*
+ * The routines below move 8 bytes at a time, and 64 bytes at a time with
+ * `ldp`/`stp` for long runs. Unaligned accesses are allowed on normal memory,
+ * so only the destination is aligned. The kernel is built with
+ * `-mgeneral-regs-only`, so no SIMD registers are used.
+ */
+
+/* A u64 that may be unaligned and may alias anything. */
+typedef u64 __attribute__((may_alias, aligned(1))) unaligned_u64;
+
+/* Copy 64 bytes from `s` to `d` with pairs of registers. */
+static ALWAYS_INLINE void copy64(u8 *d, const u8 *s)
+{
+	u64 a, b, c, e, f, g, h, i;
+	asm volatile("ldp %[a], %[b], [%[s]]\n"
+		     "ldp %[c], %[e], [%[s], #16]\n"
+		     "ldp %[f], %[g], [%[s], #32]\n"
+		     "ldp %[h], %[i], [%[s], #48]\n"
+		     "stp %[a], %[b], [%[d]]\n"
+		     "stp %[c], %[e], [%[d], #16]\n"
+		     "stp %[f], %[g], [%[d], #32]\n"
+		     "stp %[h], %[i], [%[d], #48]\n"
+		     : [a] "=&r"(a), [b] "=&r"(b), [c] "=&r"(c), [e] "=&r"(e),
+		       [f] "=&r"(f), [g] "=&r"(g), [h] "=&r"(h), [i] "=&r"(i)
+		     : [d] "r"(d), [s] "r"(s)
+		     : "memory");
+}
+
+/* Store the 8-byte pattern `v` to the 64 bytes at `d`. */
+static ALWAYS_INLINE void set64(u8 *d, u64 v)
+{
+	asm volatile("stp %[v], %[v], [%[d]]\n"
+		     "stp %[v], %[v], [%[d], #16]\n"
+		     "stp %[v], %[v], [%[d], #32]\n"
+		     "stp %[v], %[v], [%[d], #48]\n"
+		     :
+		     : [d] "r"(d), [v] "r"(v)
+		     : "memory");
+}
+
+/* The size of the block zeroed by `dc zva`, or 0 if it cannot be used. */
+static u64 zva_size = (u64)-1;
+
 void *memset(void *s, int c, usize n)
 {
-	for (usize i = 0; i < n; i++)
-		((u8 *)s)[i] = (u8)(c & 0xff);
+	u8 *d = (u8 *)s;
+	u64 v = (u8)c * 0x0101010101010101ULL;
+
+	if (n >= 16) {
+		for (; (u64)d % 8 != 0; n--)
+			*d++ = (u8)c;
+
+		// Zero whole cache blocks at once, e.g. when clearing a page.
+		if (zva_size == (u64)-1)
+			zva_size = arch_get_zva_size();
+		if (v == 0 && zva_size && n >= 2 * zva_size) {
+			for (; (u64)d % zva_size != 0; n -= 8, d += 8)
+				*(unaligned_u64 *)d = 0;
+			for (; n >= zva_size; n -= zva_size, d += zva_size)
+				arch_dc_zva(d);
+		}
+
+		for (; n >= 64; n -= 64, d += 64)
+			set64(d, v);
+		for (; n >= 8; n -= 8, d += 8)
+			*(unaligned_u64 *)d = v;
+	}
+
+	while (n-- > 0)
+		*d++ = (u8)c;
 
 	return s;
 }
 
-void *memcpy(void *restrict dest, const void *restrict src, usize n)
+/*
+ * Copy `n` bytes from `s` to `d` in ascending order. Each chunk is loaded
+ * before it is stored, so `d` may overlap `s` if it is below `s`.
+ */
+static void copy_forward(u8 *d, const u8 *s, usize n)
 {
-	for (usize i = 0; i < n; i++)
-		((u8 *)dest)[i] = ((u8 *)src)[i];
+	if (n >= 16) {
+		for (; (u64)d % 8 != 0; n--)
+			*d++ = *s++;
+		for (; n >= 64; n -= 64, d += 64, s += 64)
+			copy64(d, s);
+		for (; n >= 8; n -= 8, d += 8, s += 8)
+			*(unaligned_u64 *)d = *(const unaligned_u64 *)s;
+	}
+
+	while (n-- > 0)
+		*d++ = *s++;
+}
 
+void *memcpy(void *restrict dest, const void *restrict src, usize n)
+{
+	copy_forward((u8 *)dest, (const u8 *)src, n);
 	return dest;
 }
 
@@ -31,20 +115,28 @@ int memcmp(const void *s1, const void *s2, usize n)
 
 void *memmove(void *dest, const void *src, usize n)
 {
-	const char *s = (const char *)src;
-	char *d = (char *)dest;
+	const u8 *s = (const u8 *)src;
+	u8 *d = (u8 *)dest;
+
+	if (!(s < d && (usize)(d - s) < n)) {
+		copy_forward(d, s, n);
+		return dest;
+	}
 
-	if (s < d && (usize)(d - s) < n) {
-		s += n;
-		d += n;
-		while (n-- > 0) {
+	// `dest` begins inside `src`, so copy from the end.
+	s += n;
+	d += n;
+	if (n >= 16) {
+		for (; (u64)d % 8 != 0; n--)
 			*--d = *--s;
-		}
-	} else {
-		while (n-- > 0) {
-			*d++ = *s++;
+		for (; n >= 8; n -= 8) {
+			d -= 8;
+			s -= 8;
+			*(unaligned_u64 *)d = *(const unaligned_u64 *)s;
 		}
 	}
+	while (n-- > 0)
+		*--d = *--s;
 
 	return dest;
 }
@@ -9,6 +9,8 @@
 #include <proc/proc.h>
 #include <proc/sched.h>
 #include <vm/vmregion.h>
+#include <vm/asid.h>
+#include <vm/mmap.h>
 #include <vm/pgtbl.h>
 #include <driver/clock.h>
 #include <kernel/param.h>
@@ -36,6 +38,7 @@ define_init(idles)
 		struct proc *idle = create_idle();
 		cpus[i].sched.idle = idle;
 		cpus[i].sched.running = idle;
+		idle->schinfo.cpu = i;
 		idle->state = RUNNING;
 	}
 }
@@ -74,9 +77,22 @@ static void transfer_children(struct proc *dst, struct proc *src)
 
 NO_RETURN void exit(int code)
 {
-	acquire_spinlock(&proc_lock);
 	struct proc *p = thisproc();
 
+	// A vfork child gives the address space back to its parent. Otherwise,
+	// write back the dirty pages of shared mappings. The rest of the address
+	// space is released by the parent in `wait`.
+	if (p->vfork_parent) {
+		struct vmspace borrowed = p->vmspace;
+		init_vmspace(&p->vmspace);
+		switch_vmspace(&p->vmspace);
+		vfork_release(p, &borrowed);
+	} else {
+		mmap_sync_all(&p->vmspace);
+	}
+
+	acquire_spinlock(&proc_lock);
+
 	// Set the exit code.
 	p->exitcode = code;
 
@@ -136,10 +152,16 @@ int wait(int *exitcode)
 	int pid = zombie_child->pid;
 	*exitcode = zombie_child->exitcode;
 	free_pid(zombie_child->pid);
+	release_spinlock(&proc_lock);
+
+	// Releasing the address space may close files and sleep, so do it after
+	// the zombie has been taken off the list and the lock is released. The
+	// zombie may still be switching away on another CPU, using its stack and
+	// its ASID, so wait for it first.
+	sched_wait_inactive(zombie_child);
 	kfree_page(zombie_child->kstack);
 	destroy_vmspace(&zombie_child->vmspace);
 	kfree(zombie_child);
-	release_spinlock(&proc_lock);
 	return pid;
 }
 
@@ -162,6 +184,107 @@ int kill(int pid)
 	return -1;
 }
 
+/*
+ * Find the process `pid` among the calling process and its children, like
+ * `kill`. The caller must hold `proc_lock`.
+ */
+static struct proc *find_proc(int pid)
+{
+	if (pid == 0 || pid == thisproc()->pid)
+		return thisproc();
+	list_forall(p, thisproc()->children)
+	{
+		struct proc *cur = container_of(p, struct proc, ptnode);
+		if (cur->pid == pid && !cur->idle)
+			return cur;
+	}
+	return NULL;
+}
+
+/* Set the nice value of `pid`, 0 meaning the calling process. */
+int set_nice(int pid, int nice)
+{
+	acquire_spinlock(&proc_lock);
+	struct proc *p = find_proc(pid);
+	if (p)
+		sched_set_nice(p, nice);
+	release_spinlock(&proc_lock);
+	return p ? 0 : -1;
+}
+
+/* Get the nice value of `pid` into `nice`, 0 meaning the calling process. */
+int get_nice(int pid, int *nice)
+{
+	acquire_spinlock(&proc_lock);
+	struct proc *p = find_proc(pid);
+	if (p)
+		*nice = p->schinfo.nice;
+	release_spinlock(&proc_lock);
+	return p ? 0 : -1;
+}
+
+/*
+ * Restrict `pid`, 0 meaning the calling process, to the CPUs in `mask`. Kernel
+ * processes can use this to pin themselves to a CPU.
+ */
+int set_affinity(int pid, u64 mask)
+{
+	if (!(mask & CPU_MASK_ALL))
+		return -1;
+	acquire_spinlock(&proc_lock);
+	struct proc *p = find_proc(pid);
+	if (p)
+		sched_set_affinity(p, mask);
+	release_spinlock(&proc_lock);
+
+	// Move off this CPU right away if it is no longer allowed.
+	if (p == thisproc() && !((mask >> cpuid()) & 1))
+		yield();
+	return p ? 0 : -1;
+}
+
+int get_affinity(int pid, u64 *mask)
+{
+	acquire_spinlock(&proc_lock);
+	struct proc *p = find_proc(pid);
+	if (p)
+		*mask = p->schinfo.cpus_allowed;
+	release_spinlock(&proc_lock);
+	return p ? 0 : -1;
+}
+
+/*
+ * Set the scheduling policy of `pid`, 0 meaning the calling process. `prio`
+ * must be from 1 to MAX_RT_PRIO - 1 for SCHED_FIFO and SCHED_RR, and 0 for
+ * SCHED_OTHER.
+ */
+int set_policy(int pid, int policy, int prio)
+{
+	bool rt = policy == SCHED_FIFO || policy == SCHED_RR;
+
+	if (rt ? prio < 1 || prio >= MAX_RT_PRIO :
+		 policy != SCHED_OTHER || prio != 0)
+		return -1;
+	acquire_spinlock(&proc_lock);
+	struct proc *p = find_proc(pid);
+	if (p)
+		sched_set_policy(p, policy, prio);
+	release_spinlock(&proc_lock);
+	return p ? 0 : -1;
+}
+
+int get_policy(int pid, int *policy, int *prio)
+{
+	acquire_spinlock(&proc_lock);
+	struct proc *p = find_proc(pid);
+	if (p) {
+		*policy = p->schinfo.policy;
+		*prio = p->schinfo.rt_priority;
+	}
+	release_spinlock(&proc_lock);
+	return p ? 0 : -1;
+}
+
 int start_proc(struct proc *p, void (*entry)(u64), u64 arg)
 {
 	acquire_spinlock(&proc_lock);
@@ -191,11 +314,15 @@ void init_proc(struct proc *p, bool idle)
 	p->idle = idle;
 	p->pid = idle ? 0 : alloc_pid();
 	p->schinfo.runtime = 0;
+	p->schinfo.weight = NICE_0_WEIGHT;
+	p->schinfo.cpu = cpuid();
+	p->schinfo.cpus_allowed = CPU_MASK_ALL;
 	p->state = UNUSED;
 	p->parent = idle ? p : NULL;
 
 	// Initialize the data structures.
 	init_sem(&p->childexit, 0);
+	init_sem(&p->vforkdone, 0);
 	list_init(&p->children);
 	list_init(&p->zombie_children);
 	init_list_node(&p->ptnode);
@@ -224,6 +351,31 @@ struct proc *create_idle()
 	return p;
 }
 
+/*
+ * Make `child` return to the same user context as the calling process, with
+ * the same open files, working directory, nice value, CPU affinity and
+ * scheduling policy.
+ */
+static void copy_proc_context(struct proc *this, struct proc *child)
+{
+	// Copy saved user registers.
+	*(child->ucontext) = *(this->ucontext);
+
+	// Cause fork to return 0 in the child.
+	child->ucontext->regs[0] = 0;
+
+	// Increment reference counts on open file descriptors.
+	for (int i = 0; i < NOFILE; i++) {
+		if (this->oftable.ofiles[i] != NULL)
+			child->oftable.ofiles[i] =
+				file_dup(this->oftable.ofiles[i]);
+	}
+	child->cwd = inodes.share(this->cwd);
+	sched_set_nice(child, this->schinfo.nice);
+	sched_set_affinity(child, this->schinfo.cpus_allowed);
+	sched_set_policy(child, this->schinfo.policy, this->schinfo.rt_priority);
+}
+
 /*
  * Create a new process copying p as the parent.
  * Sets up stack to return as if from system call.
@@ -242,21 +394,49 @@ int fork()
 	copy_vmspace(&this->vmspace, &child->vmspace, false);
 #endif
 
-	// Copy saved user registers.
-	*(child->ucontext) = *(this->ucontext);
+	copy_proc_context(this, child);
 
-	// Cause fork to return 0 in the child.
-	child->ucontext->regs[0] = 0;
+	start_proc(child, trap_return, 0);
+	return child->pid;
+}
 
-	// Increment reference counts on open file descriptors.
-	for (int i = 0; i < NOFILE; i++) {
-		if (this->oftable.ofiles[i] != NULL)
-			child->oftable.ofiles[i] =
-				file_dup(this->oftable.ofiles[i]);
-	}
-	child->cwd = inodes.share(this->cwd);
+/*
+ * Create a new process that borrows the address space of the caller instead
+ * of copying it. The caller sleeps until the child calls `execve` or `exit`,
+ * which give the address space back with `vfork_release`.
+ */
+int vfork()
+{
+	struct proc *this = thisproc();
+	struct proc *child = create_proc();
 
+	init_proc(child, false);
+	set_parent_to_this(child);
+
+	destroy_vmspace(&child->vmspace);
+	child->vmspace = this->vmspace;
+	child->vfork_parent = this;
+
+	copy_proc_context(this, child);
+
+	int pid = child->pid;
 	start_proc(child, trap_return, 0);
-	arch_tlbi_vmalle1is();
-	return child->pid;
-}
\ No newline at end of file
+
+	// The address space is not ours until the child is done with it, so keep
+	// waiting even if killed.
+	unalertable_wait_sem(&this->vforkdone);
+	return pid;
+}
+
+/*
+ * Give the address space `vs` borrowed by the vfork child `p` back to its
+ * parent. `p` must no longer run on `vs`.
+ */
+void vfork_release(struct proc *p, struct vmspace *vs)
+{
+	struct proc *parent = p->vfork_parent;
+
+	p->vfork_parent = NULL;
+	parent->vmspace = *vs;
+	post_sem(&parent->vforkdone);
+}
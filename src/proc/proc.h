@@ -40,10 +40,12 @@ struct proc {
 	enum procstate state;
 	struct lock *lock;
 	struct semaphore childexit;
+	struct semaphore vforkdone; // Posted when a vfork child returns vmspace.
 	struct list children;
 	struct list zombie_children;
 	struct list_node ptnode;
 	struct proc *parent;
+	struct proc *vfork_parent; // The parent whose vmspace is borrowed.
 	struct schinfo schinfo;
 	struct vmspace vmspace;
 	struct uctx *ucontext;
@@ -62,5 +64,13 @@ NO_RETURN void exit(int code);
 WARN_RESULT int wait(int *exitcode);
 bool sleep(struct semaphore *sem, struct spinlock *lock);
 WARN_RESULT int kill(int pid);
+WARN_RESULT int set_nice(int pid, int nice);
+WARN_RESULT int get_nice(int pid, int *nice);
+WARN_RESULT int set_affinity(int pid, u64 mask);
+WARN_RESULT int get_affinity(int pid, u64 *mask);
+WARN_RESULT int set_policy(int pid, int policy, int prio);
+WARN_RESULT int get_policy(int pid, int *policy, int *prio);
 WARN_RESULT int fork();
+WARN_RESULT int vfork();
+void vfork_release(struct proc *p, struct vmspace *vs);
 void trap_return();
\ No newline at end of file
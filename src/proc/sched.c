@@ -1,5 +1,6 @@
 #include <aarch64/intrinsic.h>
 #include <driver/clock.h>
+#include <driver/interrupt.h>
 #include <kernel/cpu.h>
 #include <kernel/init.h>
 #include <kernel/mem.h>
@@ -8,29 +9,142 @@
 #include <lib/string.h>
 #include <proc/proc.h>
 #include <proc/sched.h>
+#include <proc/schedstat.h>
+#include <vm/asid.h>
 
+/* `load_avg` is a fixed-point number with LOAD_SHIFT fractional bits. */
+#define LOAD_SHIFT 10
+
+/* How long a CPU is taken to keep the data of a process in its cache, in us. */
+#define CACHE_HOT_TIME 1000
+
+/* How far behind `min_vruntime` a waking process is placed, in us. */
+#define WAKEUP_CREDIT (SCHED_LATENCY * 1000 / 2)
+
+/*
+ * The weight of each nice value, from -20 to 19. Every step changes the share
+ * of the CPU by about 10%.
+ */
+static const u32 nice_to_weight[40] = {
+	/* -20 */ 88761, 71755, 56483, 46273, 36291,
+	/* -15 */ 29154, 23254, 18705, 14949, 11916,
+	/* -10 */ 9548, 7620, 6100, 4904, 3906,
+	/*  -5 */ 3121, 2501, 1991, 1586, 1277,
+	/*   0 */ 1024, 820, 655, 526, 423,
+	/*   5 */ 335, 272, 215, 172, 137,
+	/*  10 */ 110, 87, 70, 56, 45,
+	/*  15 */ 36, 29, 23, 18, 15,
+};
+
+/**
+ * rq - the run queue of a CPU.
+ *
+ * @lock: protects the queue and the scheduling state of the processes on it.
+ * `schedule` holds it across the context switch, and the process switched to
+ * releases it. Until then, no other CPU can pick the process switched from.
+ * @root: the runnable SCHED_OTHER processes that are not running, ordered by
+ * vruntime.
+ * @rt_queue: the runnable SCHED_FIFO and SCHED_RR processes that are not
+ * running, in a FIFO list per priority.
+ * @rt_bitmap: the priorities whose list in `rt_queue` is not empty.
+ * @nr_running: the number of queued processes of all classes.
+ * @min_vruntime: a lower bound of the vruntime of the processes on the queue,
+ * including the running one. It never decreases.
+ * @slice_end: when the slice of the running process ends, in ms, or 0 if
+ * there is nothing to preempt it for. The slice timer is not armed then.
+ * @load_avg: the number of runnable processes, including the running one,
+ * averaged over the recent ticks.
+ * @ticks: the number of slices that ran out so far.
+ * @migrating: the process switched from, if it has to move to another CPU.
+ */
+struct rq {
+	struct spinlock lock;
+	struct rb_root_ root;
+	struct list_node rt_queue[MAX_RT_PRIO];
+	u64 rt_bitmap[2];
+	int cpu;
+	int nr_running;
+	u64 min_vruntime;
+	u64 slice_end;
+	u64 load_avg;
+	u64 ticks;
+	struct proc *migrating;
+};
+
+/**
+ * sched_class - the operations of a scheduling policy on a run queue. The
+ * classes are tried in order, so a runnable process of an earlier class always
+ * runs before those of the later ones. All of them are called with the run
+ * queue locked.
+ *
+ * @enqueue: add the runnable process `p` to the class queue of `rq`.
+ * @dequeue: remove `p` from it.
+ * @pick_next: the queued process of the class to run next, or NULL if there is
+ * none. It stays on the queue.
+ * @tick: whether the running process `curr` of the class should give way to
+ * a queued process of the same class. It is asked when the slice of `curr`
+ * ends and when another CPU kicks this one.
+ * @slice: the length of the next slice of `curr`, in ms, or 0 to run it
+ * without the slice timer.
+ */
+struct sched_class {
+	void (*enqueue)(struct rq *rq, struct proc *p);
+	void (*dequeue)(struct rq *rq, struct proc *p);
+	struct proc *(*pick_next)(struct rq *rq);
+	bool (*tick)(struct rq *rq, struct proc *curr);
+	u64 (*slice)(struct rq *rq, struct proc *curr);
+};
+
+/*
+ * The slice timer of each CPU. `data` is 1 while it is armed. It may stay armed
+ * after the slice it was armed for is over, and then does nothing when it fires.
+ */
 static struct timer sched_timer[NCPU];
 
-static RBTree rq[NCPU];
+static struct rq rqs[NCPU];
+
+static void __sched_handler(struct timer *t);
 
 define_early_init(rq)
 {
-	for (int i = 0; i < NCPU; i++)
-		rbtree_init(&rq[i]);
+	for (int i = 0; i < NCPU; i++) {
+		init_spinlock(&rqs[i].lock);
+		rqs[i].root.rb_node = NULL;
+		for (int j = 0; j < MAX_RT_PRIO; j++)
+			init_list_node(&rqs[i].rt_queue[j]);
+		rqs[i].cpu = i;
+	}
 }
 
-static bool __cmp_runtime(rb_node n1, rb_node n2)
+static bool __cmp_vruntime(rb_node n1, rb_node n2)
 {
-	if (container_of(n1, struct schinfo, rq_node)->runtime ==
-	    container_of(n2, struct schinfo, rq_node)->runtime)
+	if (container_of(n1, struct schinfo, rq_node)->vruntime ==
+	    container_of(n2, struct schinfo, rq_node)->vruntime)
 		return container_of(container_of(n1, struct schinfo, rq_node),
 				    struct proc, schinfo)
 			       ->pid <
 		       container_of(container_of(n2, struct schinfo, rq_node),
 				    struct proc, schinfo)
 			       ->pid;
-	return container_of(n1, struct schinfo, rq_node)->runtime <
-	       container_of(n2, struct schinfo, rq_node)->runtime;
+	return container_of(n1, struct schinfo, rq_node)->vruntime <
+	       container_of(n2, struct schinfo, rq_node)->vruntime;
+}
+
+static bool cpu_allowed(struct proc *p, int cpu)
+{
+	return (p->schinfo.cpus_allowed >> cpu) & 1;
+}
+
+static struct proc *rq_node_proc(rb_node node)
+{
+	return container_of(container_of(node, struct schinfo, rq_node),
+			    struct proc, schinfo);
+}
+
+static struct proc *rt_node_proc(ListNode *node)
+{
+	return container_of(container_of(node, struct schinfo, rt_node),
+			    struct proc, schinfo);
 }
 
 inline struct proc *thisproc()
@@ -38,111 +152,816 @@ inline struct proc *thisproc()
 	return cpus[cpuid()].sched.running;
 }
 
+/*
+ * Lock the run queue `p` belongs to. `p` may move to another queue until the
+ * lock is held, so check again afterwards.
+ */
+static struct rq *task_rq_lock(struct proc *p)
+{
+	while (1) {
+		struct rq *rq = &rqs[__atomic_load_n(&p->schinfo.cpu,
+						     __ATOMIC_RELAXED)];
+		acquire_spinlock(&rq->lock);
+		if (rq->cpu == p->schinfo.cpu)
+			return rq;
+		release_spinlock(&rq->lock);
+	}
+}
+
+/*
+ * Lock two run queues in the order of their CPUs to avoid deadlocks. They may
+ * be the same queue.
+ */
+static void double_rq_lock(struct rq *rq1, struct rq *rq2)
+{
+	if (rq1 == rq2) {
+		acquire_spinlock(&rq1->lock);
+		return;
+	}
+	if (rq1 > rq2) {
+		struct rq *t = rq1;
+		rq1 = rq2;
+		rq2 = t;
+	}
+	acquire_spinlock(&rq1->lock);
+	acquire_spinlock(&rq2->lock);
+}
+
+static void double_rq_unlock(struct rq *rq1, struct rq *rq2)
+{
+	release_spinlock(&rq1->lock);
+	if (rq1 != rq2)
+		release_spinlock(&rq2->lock);
+}
+
+/*
+ * SCHED_FIFO and SCHED_RR: the highest priority runs first. A SCHED_FIFO
+ * process runs until it sleeps or yields. A SCHED_RR process also gives way to
+ * the others of its priority every RR_SLICE_LEN ms.
+ */
+
+/* The highest priority with a queued process, or 0 if there is none. */
+static int rt_highest_prio(struct rq *rq)
+{
+	if (rq->rt_bitmap[1])
+		return 127 - __builtin_clzll(rq->rt_bitmap[1]);
+	if (rq->rt_bitmap[0])
+		return 63 - __builtin_clzll(rq->rt_bitmap[0]);
+	return 0;
+}
+
+static void enqueue_rt(struct rq *rq, struct proc *p)
+{
+	int prio = p->schinfo.rt_priority;
+
+	_insert_into_list(rq->rt_queue[prio].prev, &p->schinfo.rt_node);
+	rq->rt_bitmap[prio / 64] |= 1ull << (prio % 64);
+}
+
+static void dequeue_rt(struct rq *rq, struct proc *p)
+{
+	int prio = p->schinfo.rt_priority;
+
+	_detach_from_list(&p->schinfo.rt_node);
+	if (_empty_list(&rq->rt_queue[prio]))
+		rq->rt_bitmap[prio / 64] &= ~(1ull << (prio % 64));
+}
+
+/* The first process of the highest priority that may run on `rq`. */
+static struct proc *pick_next_rt(struct rq *rq)
+{
+	for (int i = 1; i >= 0; i--) {
+		for (u64 bits = rq->rt_bitmap[i]; bits;) {
+			int prio = i * 64 + 63 - __builtin_clzll(bits);
+			ListNode *head = &rq->rt_queue[prio];
+			for (ListNode *n = head->next; n != head; n = n->next)
+				if (cpu_allowed(rt_node_proc(n), rq->cpu))
+					return rt_node_proc(n);
+			bits &= ~(1ull << (prio % 64));
+		}
+	}
+	return NULL;
+}
+
+static bool tick_rt(struct rq *rq, struct proc *curr)
+{
+	int prio = rt_highest_prio(rq);
+
+	if (prio > curr->schinfo.rt_priority)
+		return true;
+	return curr->schinfo.policy == SCHED_RR &&
+	       prio == curr->schinfo.rt_priority && rq->slice_end != 0 &&
+	       get_timestamp_ms() >= rq->slice_end;
+}
+
+static u64 slice_rt(struct rq *rq, struct proc *curr)
+{
+	if (curr->schinfo.policy != SCHED_RR ||
+	    _empty_list(&rq->rt_queue[curr->schinfo.rt_priority]))
+		return 0;
+	return RR_SLICE_LEN;
+}
+
+/* SCHED_OTHER: the processes share the CPU in proportion to their weights. */
+
+static void enqueue_fair(struct rq *rq, struct proc *p)
+{
+	ASSERT(_rb_insert(&p->schinfo.rq_node, &rq->root, __cmp_vruntime) == 0);
+}
+
+static void dequeue_fair(struct rq *rq, struct proc *p)
+{
+	_rb_erase(&p->schinfo.rq_node, &rq->root);
+}
+
+/* The process with the least vruntime that may run on `rq`. */
+static struct proc *pick_next_fair(struct rq *rq)
+{
+	for (rb_node node = _rb_first(&rq->root); node; node = _rb_next(node))
+		if (cpu_allowed(rq_node_proc(node), rq->cpu))
+			return rq_node_proc(node);
+	return NULL;
+}
+
+static bool tick_fair(struct rq *rq, struct proc *curr)
+{
+	struct proc *next = pick_next_fair(rq);
+	return next && next->schinfo.vruntime < curr->schinfo.vruntime;
+}
+
+/*
+ * The target latency shared by the runnable processes. A process that runs
+ * alone needs no slice.
+ */
+static u64 slice_fair(struct rq *rq, struct proc *curr)
+{
+	(void)curr;
+	if (rq->nr_running == 0)
+		return 0;
+	return MAX((u64)SCHED_LATENCY / (rq->nr_running + 1), (u64)SLICE_LEN);
+}
+
+enum { CLASS_RT, CLASS_FAIR, NR_CLASSES };
+
+static const struct sched_class sched_classes[NR_CLASSES] = {
+	[CLASS_RT] = {
+		.enqueue = enqueue_rt,
+		.dequeue = dequeue_rt,
+		.pick_next = pick_next_rt,
+		.tick = tick_rt,
+		.slice = slice_rt,
+	},
+	[CLASS_FAIR] = {
+		.enqueue = enqueue_fair,
+		.dequeue = dequeue_fair,
+		.pick_next = pick_next_fair,
+		.tick = tick_fair,
+		.slice = slice_fair,
+	},
+};
+
+static const struct sched_class *class_of(struct proc *p)
+{
+	return &sched_classes[p->schinfo.policy == SCHED_OTHER ? CLASS_FAIR :
+								 CLASS_RT];
+}
+
+static void enqueue(struct rq *rq, struct proc *p)
+{
+	if (p->schinfo.cpu != rq->cpu)
+		schedstat_add(rq->cpu, nr_migrations, 1);
+	__atomic_store_n(&p->schinfo.cpu, rq->cpu, __ATOMIC_RELAXED);
+	class_of(p)->enqueue(rq, p);
+	p->schinfo.on_rq = true;
+	rq->nr_running++;
+}
+
+static void dequeue(struct rq *rq, struct proc *p)
+{
+	class_of(p)->dequeue(rq, p);
+	p->schinfo.on_rq = false;
+	rq->nr_running--;
+}
+
+/* Whether `p` should preempt `curr` as soon as it is queued. */
+static bool preempts(struct proc *p, struct proc *curr)
+{
+	if (class_of(p) != class_of(curr))
+		return class_of(p) < class_of(curr);
+	return p->schinfo.policy != SCHED_OTHER &&
+	       p->schinfo.rt_priority > curr->schinfo.rt_priority;
+}
+
+/*
+ * Whether the running process `curr` should give way: to a queued process of
+ * an earlier class, to one of its own class as the class decides, or because
+ * it may no longer run here.
+ */
+static bool need_resched(struct rq *rq, struct proc *curr)
+{
+	for (const struct sched_class *c = sched_classes; c < class_of(curr); c++)
+		if (c->pick_next(rq))
+			return true;
+	return class_of(curr)->tick(rq, curr) || !cpu_allowed(curr, rq->cpu);
+}
+
+static void update_min_vruntime(struct rq *rq)
+{
+	struct proc *curr = cpus[rq->cpu].sched.running;
+	rb_node leftmost = _rb_first(&rq->root);
+	u64 vruntime;
+
+	if (curr && !curr->idle && curr->state == RUNNING &&
+	    curr->schinfo.policy == SCHED_OTHER) {
+		vruntime = curr->schinfo.vruntime;
+		if (leftmost)
+			vruntime = MIN(vruntime,
+				       rq_node_proc(leftmost)->schinfo.vruntime);
+	} else if (leftmost) {
+		vruntime = rq_node_proc(leftmost)->schinfo.vruntime;
+	} else {
+		return;
+	}
+	rq->min_vruntime = MAX(rq->min_vruntime, vruntime);
+}
+
+/* Charge the running process of `rq` for the time since it was last charged. */
+static void update_curr(struct rq *rq)
+{
+	struct proc *curr = cpus[rq->cpu].sched.running;
+	u64 now = get_timestamp_us();
+	u64 delta = now - curr->schinfo.exec_start;
+
+	curr->schinfo.exec_start = now;
+	if (curr->idle) {
+		schedstat_add(rq->cpu, idle_time, delta);
+		return;
+	}
+	curr->schinfo.runtime += delta;
+	if (curr->schinfo.policy != SCHED_OTHER)
+		return;
+	curr->schinfo.vruntime += delta * NICE_0_WEIGHT / curr->schinfo.weight;
+	update_min_vruntime(rq);
+}
+
+/*
+ * Place a process that becomes runnable on `rq`. A process that slept keeps its
+ * vruntime unless that is too far behind, so it cannot monopolize the CPU. It
+ * gets a small credit, so that it preempts the processes that kept running.
+ */
+static void place_proc(struct rq *rq, struct proc *p, bool initial)
+{
+	u64 vruntime = rq->min_vruntime;
+	if (!initial)
+		vruntime -= MIN(vruntime, (u64)WAKEUP_CREDIT);
+	p->schinfo.vruntime = MAX(p->schinfo.vruntime, vruntime);
+}
+
+/* Carry the vruntime of `p` over from `src` to `dst`, keeping its lag. */
+static void move_vruntime(struct rq *dst, struct rq *src, struct proc *p)
+{
+	i64 lag = (i64)(p->schinfo.vruntime - src->min_vruntime);
+
+	if (lag < 0 && (u64)-lag > dst->min_vruntime)
+		p->schinfo.vruntime = 0;
+	else
+		p->schinfo.vruntime = dst->min_vruntime + lag;
+}
+
+/* Move the runnable process `p` from `src` to `dst`. */
+static void migrate_proc(struct rq *dst, struct rq *src, struct proc *p)
+{
+	dequeue(src, p);
+	move_vruntime(dst, src, p);
+	enqueue(dst, p);
+}
+
+void sched_set_nice(struct proc *p, int nice)
+{
+	struct rq *rq = task_rq_lock(p);
+
+	nice = MAX(MIN(nice, 19), -20);
+	// Charge the time run so far at the old weight.
+	if (p->state == RUNNING)
+		update_curr(rq);
+	p->schinfo.nice = nice;
+	p->schinfo.weight = nice_to_weight[nice + 20];
+	release_spinlock(&rq->lock);
+}
+
+/*
+ * Switch `p` to `policy` with the priority `prio`, which the caller checked. A
+ * process that becomes SCHED_OTHER is placed as if it woke up, since its
+ * vruntime stood still meanwhile. The CPU of `p` is kicked to see whether it
+ * should switch now.
+ */
+void sched_set_policy(struct proc *p, int policy, int prio)
+{
+	struct rq *rq = task_rq_lock(p);
+	bool queued = p->schinfo.on_rq;
+
+	if (p->state == RUNNING)
+		update_curr(rq);
+	if (queued)
+		dequeue(rq, p);
+	if (policy == SCHED_OTHER && p->schinfo.policy != SCHED_OTHER)
+		place_proc(rq, p, false);
+	p->schinfo.policy = policy;
+	p->schinfo.rt_priority = prio;
+	if (queued)
+		enqueue(rq, p);
+	if ((queued || p->state == RUNNING) && !p->idle)
+		send_ipi(rq->cpu, IPI_RESCHEDULE);
+	release_spinlock(&rq->lock);
+}
+
+/*
+ * Make sure that the slice timer fires by `slice_end`. An armed timer is only
+ * moved if it would fire too late, so most switches leave the timer queue
+ * alone. `rq` must be the locked queue of this CPU.
+ */
+static void arm_slice_timer(struct rq *rq)
+{
+	struct timer *t = &sched_timer[rq->cpu];
+
+	if (t->data == 1) {
+		if (t->_key <= rq->slice_end)
+			return;
+		cancel_cpu_timer(t);
+	}
+	t->elapse = rq->slice_end - MIN(rq->slice_end, get_timestamp_ms());
+	t->handler = __sched_handler;
+	set_cpu_timer(t);
+	t->data = 1;
+}
+
+/*
+ * Start a slice for the running process, as long as its class asks for. The
+ * idle process runs without the slice timer. `rq` must be the locked queue of
+ * this CPU.
+ */
+static void start_slice(struct rq *rq)
+{
+	struct proc *curr = cpus[rq->cpu].sched.running;
+	u64 slice = curr->idle ? 0 : class_of(curr)->slice(rq, curr);
+
+	if (slice == 0) {
+		rq->slice_end = 0;
+		return;
+	}
+	rq->slice_end = get_timestamp_ms() + slice;
+	arm_slice_timer(rq);
+}
+
+static bool cpu_idle(struct proc *p, int cpu)
+{
+	return cpu_allowed(p, cpu) && cpus[cpu].online &&
+	       cpus[cpu].sched.running->idle &&
+	       __atomic_load_n(&rqs[cpu].nr_running, __ATOMIC_RELAXED) == 0;
+}
+
+/* Any CPU that `p` may run on, preferring `cpu`. */
+static int allowed_cpu(struct proc *p, int cpu)
+{
+	if (!cpu_allowed(p, cpu))
+		cpu = __builtin_ctzll(p->schinfo.cpus_allowed);
+	return cpu;
+}
+
+/*
+ * Choose the CPU to wake `p` up on. A process that ran just before it slept
+ * goes to the CPU of its waker, if nothing else waits there: the two most
+ * likely share data that is still in the cache. Otherwise, an idle CPU is
+ * preferred, starting with the one `p` last ran on. Only the CPUs in
+ * `cpus_allowed` are considered. The queues are read without locks, so the
+ * choice is only a hint.
+ */
+static int select_task_rq(struct proc *p)
+{
+	int prev = p->schinfo.cpu;
+	int this = cpuid();
+
+	if (cpu_allowed(p, this) &&
+	    get_timestamp_us() - p->schinfo.exec_start < CACHE_HOT_TIME &&
+	    __atomic_load_n(&rqs[this].nr_running, __ATOMIC_RELAXED) == 0)
+		return this;
+	if (cpu_idle(p, prev))
+		return prev;
+	for (int i = 0; i < NCPU; i++)
+		if (cpu_idle(p, i))
+			return i;
+	return allowed_cpu(p, prev);
+}
+
+/*
+ * Make sure that the CPU of `rq` notices the process `p` just queued on it.
+ * This CPU starts a slice if it ran without one. Another CPU is kicked with an
+ * IPI if it is idle or runs without a slice, since it would not look at its
+ * queue otherwise. If `p` preempts the running process, the CPU is kicked in
+ * any case, this one included: the IPI is taken as soon as interrupts are on.
+ */
+static void kick_rq(struct rq *rq, struct proc *p)
+{
+	struct proc *curr = cpus[rq->cpu].sched.running;
+
+	if (!curr->idle && preempts(p, curr)) {
+		send_ipi(rq->cpu, IPI_RESCHEDULE);
+	} else if (rq->cpu == cpuid()) {
+		if (rq->slice_end == 0)
+			start_slice(rq);
+	} else if (rq->slice_end == 0) {
+		send_ipi(rq->cpu, IPI_RESCHEDULE);
+	}
+}
+
+/*
+ * Handle IPI_RESCHEDULE. Start the slice that `kick_rq` asked for, or give way
+ * right away if the running process should (see `need_resched`).
+ */
+static void __resched_handler()
+{
+	struct rq *rq = &rqs[cpuid()];
+	struct proc *curr = thisproc();
+	bool preempt;
+
+	// The idle loop looks at the queue once the interrupt returns.
+	if (curr->idle)
+		return;
+
+	acquire_spinlock(&rq->lock);
+	update_curr(rq);
+	preempt = need_resched(rq, curr);
+	if (!preempt && rq->slice_end == 0)
+		start_slice(rq);
+	release_spinlock(&rq->lock);
+	if (preempt)
+		schedule(RUNNABLE);
+}
+
+define_early_init(resched_ipi)
+{
+	set_ipi_handler(IPI_RESCHEDULE, __resched_handler);
+}
+
+/*
+ * Lock the queue of `cpu` while holding `rq`, to move a process there. The
+ * queues are always locked in order, so if `cpu` comes first we can only try.
+ * Returns NULL if the lock is not taken.
+ */
+static struct rq *lock_target_rq(struct rq *rq, int cpu)
+{
+	struct rq *dst = &rqs[cpu];
+
+	if (dst > rq)
+		acquire_spinlock(&dst->lock);
+	else if (!__try_acquire_spinlock(&dst->lock))
+		return NULL;
+	return dst;
+}
+
+/*
+ * Lock `rq`, which the runnable but unqueued `p` belongs to, together with the
+ * queue of a CPU that `p` may run on, preferring `cpu`. Its affinity changes
+ * under the lock of `rq`, which is not held yet, so it is checked again once
+ * both locks are. The two queues may be the same.
+ */
+static struct rq *lock_allowed_rq(struct rq *rq, struct proc *p, int cpu)
+{
+	while (1) {
+		struct rq *dst = &rqs[allowed_cpu(p, cpu)];
+		double_rq_lock(rq, dst);
+		if (cpu_allowed(p, dst->cpu))
+			return dst;
+		double_rq_unlock(rq, dst);
+	}
+}
+
 bool _activate_proc(struct proc *p, bool onalert)
 {
+	struct rq *rq = task_rq_lock(p);
+	bool ret = false;
+
 	if ((onalert && p->state == DEEPSLEEPING) || p->state == RUNNING ||
 	    p->state == RUNNABLE || p->state == ZOMBIE) {
-		return false;
-	}
-
-	if (p->state == SLEEPING || p->state == UNUSED ||
-	    p->state == DEEPSLEEPING) {
+		ret = false;
+	} else if (p->state == SLEEPING || p->state == UNUSED ||
+		   p->state == DEEPSLEEPING) {
 		// Put the process into runnable queue.
+		bool initial = p->state == UNUSED;
 		p->state = RUNNABLE;
 		if (!p->idle) {
-			rbtree_lock(&rq[(p->pid) % NCPU]);
-			rbtree_insert(&rq[(p->pid) % NCPU],
-				      &(p->schinfo.rq_node), __cmp_runtime);
-			rbtree_unlock(&rq[(p->pid) % NCPU]);
+			p->schinfo.wake_start = get_timestamp_us();
+			int cpu = select_task_rq(p);
+			struct rq *dst = rq;
+			// If the target queue can only be tried and is busy, lock
+			// both in order. `p` is RUNNABLE and on no queue meanwhile.
+			if (cpu != rq->cpu && !(dst = lock_target_rq(rq, cpu))) {
+				release_spinlock(&rq->lock);
+				dst = lock_allowed_rq(rq, p, cpu);
+			}
+			if (dst != rq) {
+				move_vruntime(dst, rq, p);
+				release_spinlock(&rq->lock);
+				rq = dst;
+			}
+			place_proc(rq, p, initial);
+			enqueue(rq, p);
+			kick_rq(rq, p);
 		}
-		return true;
+		ret = true;
 	}
-	return false;
+	release_spinlock(&rq->lock);
+	return ret;
 }
 
-static void update_this_state(enum procstate new_state)
+/*
+ * Restrict `p` to the CPUs in `mask`, which must not be empty. A queued
+ * process is moved right away if it can be. A process running elsewhere is
+ * preempted, and moves when it gives up the CPU (see `update_this_state`).
+ * The caller moves itself by yielding.
+ */
+void sched_set_affinity(struct proc *p, u64 mask)
 {
-	ASSERT(new_state != RUNNING);
+	struct rq *rq, *dst;
 
-	if (new_state == RUNNABLE && !thisproc()->idle) {
-		rbtree_lock(&rq[cpuid()]);
-		rbtree_insert(&rq[cpuid()], &(thisproc()->schinfo.rq_node),
-			      __cmp_runtime);
-		rbtree_unlock(&rq[cpuid()]);
+	ASSERT(mask & CPU_MASK_ALL);
+	mask &= CPU_MASK_ALL;
+
+	// Lock the queue of `p` together with the first queue of `mask`, in
+	// order. `p` may move until then, in which case try again.
+	while (1) {
+		rq = &rqs[__atomic_load_n(&p->schinfo.cpu, __ATOMIC_RELAXED)];
+		dst = (mask >> rq->cpu) & 1 ? rq : &rqs[__builtin_ctzll(mask)];
+		double_rq_lock(rq, dst);
+		if (rq->cpu == p->schinfo.cpu)
+			break;
+		double_rq_unlock(rq, dst);
+	}
+
+	p->schinfo.cpus_allowed = mask;
+	if (dst != rq && !p->idle) {
+		if (p->schinfo.on_rq) {
+			migrate_proc(dst, rq, p);
+			kick_rq(dst, p);
+		} else if (p->state == RUNNING && rq->cpu != cpuid()) {
+			send_ipi(rq->cpu, IPI_RESCHEDULE);
+		}
+	}
+	double_rq_unlock(rq, dst);
+}
+
+/*
+ * Wait until the exiting process `p` has switched away for good, so that its
+ * kernel stack and address space may be freed. It becomes ZOMBIE under its run
+ * queue lock, which is held until the switch is done.
+ */
+void sched_wait_inactive(struct proc *p)
+{
+	while (1) {
+		struct rq *rq = task_rq_lock(p);
+		bool inactive = p->state == ZOMBIE;
+		release_spinlock(&rq->lock);
+		if (inactive)
+			return;
+		arch_yield();
+	}
+}
+
+/*
+ * Move up to `n` processes from `src` to `dst`. Both queues must be locked.
+ * Only SCHED_OTHER processes are moved: the others stay on the CPU they were
+ * woken up on. Returns the number of processes moved.
+ */
+static int pull_tasks(struct rq *dst, struct rq *src, int n)
+{
+	int moved = 0;
+	rb_node node = _rb_first(&src->root);
+
+	while (node && moved < n) {
+		struct proc *p = rq_node_proc(node);
+		node = _rb_next(node);
+		if (!cpu_allowed(p, dst->cpu))
+			continue;
+		migrate_proc(dst, src, p);
+		moved++;
 	}
+	return moved;
+}
+
+/*
+ * Find the run queue other than `rq` with the highest load, among those with
+ * at least `min_running` processes waiting. The counters are read without
+ * locks, so the result is only a hint.
+ */
+static struct rq *find_busiest(struct rq *rq, int min_running)
+{
+	struct rq *busiest = NULL;
+
+	for (int i = 0; i < NCPU; i++) {
+		struct rq *r = &rqs[i];
+		if (r == rq || __atomic_load_n(&r->nr_running,
+					       __ATOMIC_RELAXED) < min_running)
+			continue;
+		if (!busiest || r->load_avg > busiest->load_avg ||
+		    (r->load_avg == busiest->load_avg &&
+		     r->nr_running > busiest->nr_running))
+			busiest = r;
+	}
+	return busiest;
+}
+
+/*
+ * Steal a process for the empty `rq`, which is locked. The other queue is only
+ * tried, since a CPU that holds its own queue may be trying to lock ours.
+ */
+static bool steal_task(struct rq *rq)
+{
+	struct rq *busiest = find_busiest(rq, 1);
+	bool ret = false;
+
+	if (busiest && __try_acquire_spinlock(&busiest->lock)) {
+		ret = pull_tasks(rq, busiest, 1) > 0;
+		release_spinlock(&busiest->lock);
+	}
+	return ret;
+}
+
+/*
+ * Even out the queue lengths of `rq` and the busiest other queue, if they
+ * differ by two or more. Called periodically from the slice timer.
+ */
+static void load_balance(struct rq *rq)
+{
+	struct rq *busiest = find_busiest(rq, 2);
+	if (!busiest)
+		return;
+
+	double_rq_lock(rq, busiest);
+	int imbalance = busiest->nr_running - rq->nr_running;
+	if (imbalance >= 2)
+		pull_tasks(rq, busiest, imbalance / 2);
+	double_rq_unlock(rq, busiest);
+}
+
+static void update_load(struct rq *rq)
+{
+	u64 load = (u64)rq->nr_running + !thisproc()->idle;
+	rq->load_avg = (rq->load_avg * 7 + (load << LOAD_SHIFT)) / 8;
+}
+
+static void update_this_state(struct rq *rq, enum procstate new_state)
+{
+	ASSERT(new_state != RUNNING);
 
-	if ((new_state == SLEEPING || new_state == ZOMBIE) &&
-	    (thisproc()->state == RUNNABLE)) {
-		rbtree_lock(&rq[cpuid()]);
-		rbtree_erase(&rq[cpuid()], &(thisproc()->schinfo.rq_node));
-		rbtree_unlock(&rq[cpuid()]);
+	// A process that may no longer run here is queued elsewhere, once its
+	// context is saved (see `finish_switch`).
+	if (new_state == RUNNABLE && !thisproc()->idle) {
+		if (cpu_allowed(thisproc(), rq->cpu))
+			enqueue(rq, thisproc());
+		else
+			rq->migrating = thisproc();
 	}
 
 	thisproc()->state = new_state;
 }
 
-static struct proc *pick_next()
+/* The first process of the first class that has one queued. */
+static struct proc *pick_next_class(struct rq *rq)
+{
+	for (int i = 0; i < NR_CLASSES; i++) {
+		struct proc *p = sched_classes[i].pick_next(rq);
+		if (p)
+			return p;
+	}
+	return NULL;
+}
+
+static struct proc *pick_next(struct rq *rq)
 {
-	rb_node next_node = rbtree_first(&rq[cpuid()]);
-	if (next_node)
-		return container_of(container_of(next_node, struct schinfo,
-						 rq_node),
-				    struct proc, schinfo);
-	return cpus[cpuid()].sched.idle;
+	struct proc *next = pick_next_class(rq);
+	if (!next && steal_task(rq))
+		next = pick_next_class(rq);
+	return next ? next : cpus[rq->cpu].sched.idle;
 }
 
+/*
+ * Handle the end of a slice. The running process keeps the CPU for another
+ * slice unless it should give way (see `need_resched`).
+ */
 static void __sched_handler(struct timer *t)
 {
+	struct rq *rq = &rqs[cpuid()];
+	struct proc *curr = thisproc();
+	bool expired, preempt;
+
+	acquire_spinlock(&rq->lock);
 	t->data = 0;
-	thisproc()->schinfo.runtime += SLICE_LEN;
-	schedule(RUNNABLE);
+	update_load(rq);
+	// The slice may have been restarted or dropped since the timer was armed.
+	expired = rq->slice_end != 0 && get_timestamp_ms() >= rq->slice_end;
+	if (!expired && rq->slice_end != 0)
+		arm_slice_timer(rq);
+	release_spinlock(&rq->lock);
+	if (!expired)
+		return;
+
+	if (++rq->ticks % BALANCE_INTERVAL == 0)
+		load_balance(rq);
+
+	acquire_spinlock(&rq->lock);
+	update_curr(rq);
+	preempt = need_resched(rq, curr);
+	if (!preempt)
+		start_slice(rq);
+	release_spinlock(&rq->lock);
+	if (preempt)
+		schedule(RUNNABLE);
 }
 
-static void update_this_proc(struct proc *p)
+static void update_this_proc(struct rq *rq, struct proc *p)
 {
-	// Reset the current timer
-	if (sched_timer[cpuid()].data == 1) {
-		cancel_cpu_timer(&sched_timer[cpuid()]);
-		sched_timer[cpuid()].data = 0;
-	}
-
-	// Set the timer for this p
 	cpus[cpuid()].sched.running = p;
-	sched_timer[cpuid()].elapse = SLICE_LEN;
-	sched_timer[cpuid()].handler = __sched_handler;
-	set_cpu_timer(&sched_timer[cpuid()]);
-	sched_timer[cpuid()].data = 1;
 
 	// Fetch p from rq and mark it as RUNNING
 	p->state = RUNNING;
-	if (!p->idle) {
-		rbtree_lock(&rq[cpuid()]);
-		rbtree_erase(&rq[cpuid()], &(p->schinfo.rq_node));
-		rbtree_unlock(&rq[cpuid()]);
+	p->schinfo.exec_start = get_timestamp_us();
+	if (!p->idle)
+		dequeue(rq, p);
+	if (p->schinfo.wake_start) {
+		schedstat_wakeup_latency(rq->cpu, p->schinfo.exec_start -
+							  p->schinfo.wake_start);
+		p->schinfo.wake_start = 0;
 	}
+
+	start_slice(rq);
+}
+
+/*
+ * Finish a switch to the running process by releasing the run queue lock that
+ * the process switched from took. If that process may not run on this CPU, it
+ * is queued on one that it may run on. It is RUNNABLE meanwhile, so it is not
+ * woken up, and it is on no queue to be stolen from.
+ */
+static void finish_switch()
+{
+	struct rq *rq = &rqs[cpuid()];
+	struct proc *p = rq->migrating;
+
+	rq->migrating = NULL;
+	release_spinlock(&rq->lock);
+	if (!p)
+		return;
+
+	struct rq *dst = lock_allowed_rq(rq, p, rq->cpu);
+	move_vruntime(dst, rq, p);
+	enqueue(dst, p);
+	kick_rq(dst, p);
+	double_rq_unlock(rq, dst);
 }
 
 void schedule(enum procstate new_state)
+{
+	schedule_unlock(new_state, NULL);
+}
+
+/*
+ * Like `schedule`, but release `lock`, if any, right after the state of the
+ * process changes under the run queue lock. A process going to sleep on an
+ * object protected by `lock` cannot miss a wakeup then: the waker takes `lock`
+ * first, and finds the process asleep once it gets the run queue lock.
+ */
+void schedule_unlock(enum procstate new_state, struct spinlock *lock)
 {
 	struct proc *this = thisproc();
+	struct rq *rq = &rqs[cpuid()];
 	ASSERT(this->state == RUNNING);
 
 	// If the current process is marked as killed, it shouldn't be scheduled as
-	// usual.
-	if (this->killed && new_state != ZOMBIE) {
+	// usual. An unalertable sleep still goes ahead, since it is only woken up
+	// by a post.
+	if (this->killed && new_state != ZOMBIE && new_state != DEEPSLEEPING) {
+		if (lock)
+			release_spinlock(lock);
 		return;
 	}
 
+	acquire_spinlock(&rq->lock);
+	update_curr(rq);
+
 	// Set the state for the old process.
-	update_this_state(new_state);
+	update_this_state(rq, new_state);
+	if (lock)
+		release_spinlock(lock);
 
 	// Pick the new process.
-	struct proc *next = pick_next();
+	struct proc *next = pick_next(rq);
+	schedstat_add(rq->cpu, nr_picks, 1);
+	schedstat_add(rq->cpu, rq_len_sum, rq->nr_running);
 
 	ASSERT(next->state == RUNNABLE);
 
 	// Update the state of the process.
-	update_this_proc(next);
+	update_this_proc(rq, next);
 
 	/**
      * If the picked process is another process,
@@ -150,13 +969,30 @@ void schedule(enum procstate new_state)
      * before switching.
      */
 	if (next != this) {
-		set_page_table(next->vmspace.pgtbl);
+		schedstat_add(rq->cpu, nr_switches, 1);
+		switch_vmspace(&next->vmspace);
 		swtch(next->kcontext, &(this->kcontext));
 	}
+
+	// We may be back on another CPU, whose queue was locked by the process
+	// that switched to us.
+	finish_switch();
 }
 
 u64 proc_entry(void (*entry)(u64), u64 arg)
 {
+	// A new process starts here rather than in `schedule`.
+	finish_switch();
 	set_return_addr(entry);
 	return arg;
-}
\ No newline at end of file
+}
+
+/* Take a snapshot of the statistics of `cpu`, without locks. */
+void get_schedstat(int cpu, struct schedstat *st)
+{
+	u64 *src = (u64 *)&schedstats[cpu], *dst = (u64 *)st;
+
+	for (usize i = 0; i < sizeof(*st) / sizeof(u64); i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	st->nr_running = __atomic_load_n(&rqs[cpu].nr_running, __ATOMIC_RELAXED);
+}
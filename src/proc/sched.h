@@ -7,9 +7,24 @@
 #define alert_proc(proc) _activate_proc(proc, true)
 #define yield() (schedule(RUNNABLE))
 
+#define CPU_MASK_ALL ((1ull << NCPU) - 1)
+
+/* Scheduling policies, numbered as in Linux. */
+#define SCHED_OTHER 0
+#define SCHED_FIFO 1
+#define SCHED_RR 2
+
+/* SCHED_FIFO and SCHED_RR priorities range from 1 to MAX_RT_PRIO - 1. */
+#define MAX_RT_PRIO 100
+
 extern u64 proc_entry();
 bool _activate_proc(struct proc *, bool onalert);
 void schedule(enum procstate new_state);
+void schedule_unlock(enum procstate new_state, struct spinlock *lock);
+void sched_set_nice(struct proc *p, int nice);
+void sched_set_affinity(struct proc *p, u64 mask);
+void sched_set_policy(struct proc *p, int policy, int prio);
+void sched_wait_inactive(struct proc *p);
 WARN_RESULT struct proc *thisproc();
 void swtch(KernelContext *new_ctx, KernelContext **old_ctx);
 void trap_return();
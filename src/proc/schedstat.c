@@ -0,0 +1,67 @@
+#include <kernel/mem.h>
+#include <lib/format.h>
+#include <proc/schedstat.h>
+#include <vm/uaccess.h>
+
+struct schedstat schedstats[NCPU];
+
+/* Count a wakeup of a process that waited `latency` us to run on `cpu`. */
+void schedstat_wakeup_latency(int cpu, u64 latency)
+{
+	int bucket = latency ? 63 - __builtin_clzll(latency) : 0;
+
+	bucket = MIN(bucket, SCHEDSTAT_LAT_BUCKETS - 1);
+	schedstat_add(cpu, wakeup_latency[bucket], 1);
+	schedstat_add(cpu, wakeup_latency_sum, latency);
+	schedstat_add(cpu, nr_wakeups, 1);
+}
+
+struct text_buf {
+	char *buf;
+	usize len;
+};
+
+static void __put_char(void *ctx, char c)
+{
+	struct text_buf *tb = ctx;
+	if (tb->len < PAGE_SIZE)
+		tb->buf[tb->len++] = c;
+}
+
+/*
+ * Read the statistics of all CPUs as text, like `/proc/schedstat`. Each CPU
+ * has a line of counters and a line with the wakeup latency histogram.
+ */
+isize schedstat_read(struct inode *ip, char *dst, usize offset, isize n)
+{
+	struct text_buf tb = { .buf = kalloc_page(), .len = 0 };
+	struct schedstat st;
+	isize r = 0;
+
+	(void)ip;
+	if (!tb.buf)
+		return -1;
+	format(__put_char, &tb,
+	       "# cpu switches migrations idle_us nr_running rq_len_sum "
+	       "picks wakeups wakeup_latency_us\n");
+	for (int i = 0; i < NCPU; i++) {
+		get_schedstat(i, &st);
+		format(__put_char, &tb,
+		       "cpu%d %llu %llu %llu %llu %llu %llu %llu %llu\n", i,
+		       st.nr_switches, st.nr_migrations, st.idle_time,
+		       st.nr_running, st.rq_len_sum, st.nr_picks, st.nr_wakeups,
+		       st.wakeup_latency_sum);
+		format(__put_char, &tb, "lat%d", i);
+		for (int j = 0; j < SCHEDSTAT_LAT_BUCKETS; j++)
+			format(__put_char, &tb, " %llu", st.wakeup_latency[j]);
+		format(__put_char, &tb, "\n");
+	}
+
+	if (offset < tb.len) {
+		r = MIN((usize)n, tb.len - offset);
+		if (copy_out(dst, tb.buf + offset, r) < 0)
+			r = -1;
+	}
+	kfree_page(tb.buf);
+	return r;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <fs/inode.h>
+#include <kernel/param.h>
+#include <lib/defines.h>
+
+/* The device major number of the scheduling statistics. */
+#define SCHEDSTAT_MAJOR 2
+
+/* Wakeup latencies are counted in powers of two of us, from 1 us to 32 ms. */
+#define SCHEDSTAT_LAT_BUCKETS 16
+
+/**
+ * schedstat - the scheduling statistics of a CPU.
+ *
+ * Each CPU adds to its own counters with relaxed atomics, except that a CPU
+ * that moves a process to another one counts the migration there. Readers take
+ * no locks, so a snapshot may be slightly inconsistent.
+ *
+ * @nr_switches: the number of switches to another process.
+ * @nr_migrations: the number of processes queued here that were last on
+ * another CPU.
+ * @idle_time: the time the idle process ran, in us.
+ * @nr_running: the number of processes waiting in the run queue, when read.
+ * @rq_len_sum: the sum of the run queue length at each pick, so that
+ * `rq_len_sum / nr_picks` is the average length.
+ * @nr_picks: the number of calls to `schedule`.
+ * @nr_wakeups: the number of processes woken up to run here.
+ * @wakeup_latency_sum: the sum of the time from wakeup to running, in us.
+ * @wakeup_latency: the histogram of that time. Bucket `i` counts latencies from
+ * 2^i us up to 2^(i + 1) us, except that the first one starts at 0 and the last
+ * one has no end.
+ */
+struct schedstat {
+	u64 nr_switches;
+	u64 nr_migrations;
+	u64 idle_time;
+	u64 nr_running;
+	u64 rq_len_sum;
+	u64 nr_picks;
+	u64 nr_wakeups;
+	u64 wakeup_latency_sum;
+	u64 wakeup_latency[SCHEDSTAT_LAT_BUCKETS];
+};
+
+extern struct schedstat schedstats[NCPU];
+
+#define schedstat_add(cpu, field, n) \
+	__atomic_fetch_add(&schedstats[cpu].field, (n), __ATOMIC_RELAXED)
+
+void schedstat_wakeup_latency(int cpu, u64 latency);
+void get_schedstat(int cpu, struct schedstat *st);
+isize schedstat_read(struct inode *ip, char *dst, usize offset, isize n);
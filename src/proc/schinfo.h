@@ -5,12 +5,48 @@
 
 struct proc;
 
+/* The weight of a process with nice 0. */
+#define NICE_0_WEIGHT 1024
+
 struct sched {
 	struct proc *running;
 	struct proc *idle;
 };
 
+/**
+ * schinfo - the scheduling state of a process.
+ *
+ * @rq_node: link a SCHED_OTHER process into the run queue of `cpu` while it is
+ * runnable but not running.
+ * @rt_node: the same for a SCHED_FIFO or SCHED_RR process.
+ * @runtime: the time the process has run, in us.
+ * @vruntime: `runtime` scaled by NICE_0_WEIGHT / `weight`. The run queue is
+ * ordered by it.
+ * @exec_start: when the process last started running or was accounted, in us.
+ * @wake_start: when the process was last woken up, in us, or 0 if it has run
+ * since.
+ * @nice: the nice value, from -20 to 19.
+ * @weight: the share of the CPU that goes with `nice`.
+ * @cpu: the CPU whose run queue the process is on, or last ran on. It only
+ * changes with the lock of that run queue held.
+ * @on_rq: whether the process is in the run queue of `cpu`.
+ * @cpus_allowed: the mask of the CPUs the process may run on.
+ * @policy: the scheduling policy, which selects the scheduling class.
+ * @rt_priority: the priority of a SCHED_FIFO or SCHED_RR process, from 1 to
+ * 99, higher first. It is 0 for SCHED_OTHER.
+ */
 struct schinfo {
 	struct rb_node_ rq_node;
+	struct list_node rt_node;
 	u64 runtime;
+	u64 vruntime;
+	u64 exec_start;
+	u64 wake_start;
+	int nice;
+	u32 weight;
+	int cpu;
+	bool on_rq;
+	u64 cpus_allowed;
+	int policy;
+	int rt_priority;
 };
\ No newline at end of file
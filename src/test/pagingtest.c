@@ -28,13 +28,7 @@ void pgfault_first_test()
 	struct vmspace *vm = &p->vmspace;
 	ASSERT(vm->pgtbl); // make sure the attached pt is valid
 	set_page_table(vm->pgtbl);
-	struct vmregion *st = NULL;
-	_for_in_list(node, vm->vmregions.head)
-	{
-		st = container_of(node, struct vmregion, stnode);
-		if (st->flags & VMR_HEAP)
-			break;
-	}
+	struct vmregion *st = vm->heap;
 	ASSERT(st);
 
 	// lazy allocation
@@ -87,13 +81,7 @@ void pgfault_second_test()
 	struct vmspace *pd = &thisproc()->vmspace;
 	init_vmspace(pd);
 	set_page_table(pd->pgtbl);
-	struct vmregion *st = NULL;
-	_for_in_list(node, pd->vmregions.head)
-	{
-		st = container_of(node, struct vmregion, stnode);
-		if (st->flags & VMR_HEAP)
-			break;
-	}
+	struct vmregion *st = pd->heap;
 	ASSERT(st);
 
 	// COW + lazy allocation
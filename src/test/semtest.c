@@ -0,0 +1,65 @@
+#include <aarch64/intrinsic.h>
+#include <lib/printk.h>
+#include <lib/sem.h>
+#include <proc/proc.h>
+#include <proc/sched.h>
+#include <test/test.h>
+
+#define ROUNDS 10000
+
+void set_parent_to_this(struct proc *proc);
+
+static Semaphore ping, pong;
+
+static void ping_proc(u64 rounds)
+{
+	for (u64 i = 0; i < rounds; i++) {
+		post_sem(&ping);
+		unalertable_wait_sem(&pong);
+	}
+	exit(0);
+}
+
+static void pong_proc(u64 rounds)
+{
+	for (u64 i = 0; i < rounds; i++) {
+		unalertable_wait_sem(&ping);
+		post_sem(&pong);
+	}
+	exit(0);
+}
+
+static void start_pinned(void (*entry)(u64), int cpu)
+{
+	struct proc *p = create_proc();
+	init_proc(p, false);
+	set_parent_to_this(p);
+	sched_set_affinity(p, 1ull << cpu);
+	start_proc(p, entry, ROUNDS);
+}
+
+/* Report how long ROUNDS round trips take between processes on two CPUs. */
+static void ping_pong(const char *name, int cpu1, int cpu2)
+{
+	i64 f = get_clock_frequency();
+	int code;
+
+	init_sem(&ping, 0);
+	init_sem(&pong, 0);
+	i64 t = (i64)get_timestamp();
+	start_pinned(ping_proc, cpu1);
+	start_pinned(pong_proc, cpu2);
+	for (int i = 0; i < 2; i++)
+		ASSERT(wait(&code) != -1 && code == 0);
+	t = (i64)get_timestamp() - t;
+	printk("- %s: %lld ticks for %d round trips, %lld ns each\n", name, t,
+	       ROUNDS, t * 1000000 / (f / 1000) / ROUNDS);
+}
+
+/* Semaphore ping-pong between two processes, on one CPU and on two. */
+void sem_test()
+{
+	ping_pong("same CPU", 0, 0);
+	ping_pong("two CPUs", 0, 1);
+	printk("sem_test PASS\n");
+}
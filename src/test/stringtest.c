@@ -0,0 +1,88 @@
+#include <aarch64/intrinsic.h>
+#include <aarch64/mmu.h>
+#include <lib/printk.h>
+#include <lib/string.h>
+
+#define ROUNDS 1000
+
+static u8 src[2 * PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+static u8 dst[2 * PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
+/* The byte-at-a-time copy that the optimized routines replaced. */
+static void byte_copy(volatile u8 *d, const u8 *s, usize n)
+{
+	for (usize i = 0; i < n; i++)
+		d[i] = s[i];
+}
+
+static void check(bool cond)
+{
+	if (!cond)
+		PANIC();
+}
+
+/* Check the routines at every alignment and at lengths around the steps. */
+static void string_check()
+{
+	usize lens[] = { 0, 1, 7, 8, 15, 16, 63, 64, 65, 200, 1000, PAGE_SIZE };
+
+	for (usize k = 0; k < sizeof(lens) / sizeof(lens[0]); k++) {
+		usize n = lens[k];
+		for (usize off = 0; off < 16; off++) {
+			for (usize i = 0; i < sizeof(src); i++)
+				src[i] = (u8)(i * 7 + 1);
+
+			memset(dst, 0xAA, sizeof(dst));
+			memcpy(dst + off, src + 3, n);
+			for (usize i = 0; i < n; i++)
+				check(dst[off + i] == src[3 + i]);
+			check(dst[off + n] == 0xAA);
+
+			memset(dst + off, 0, n);
+			for (usize i = 0; i < n; i++)
+				check(dst[off + i] == 0);
+			check(dst[off + n] == 0xAA);
+
+			// Overlapping moves in both directions.
+			memmove(src + off + 5, src + off, n);
+			for (usize i = 0; i < n; i++)
+				check(src[off + 5 + i] == (u8)((off + i) * 7 + 1));
+			for (usize i = 0; i < sizeof(src); i++)
+				src[i] = (u8)(i * 7 + 1);
+			memmove(src + off, src + off + 9, n);
+			for (usize i = 0; i < n; i++)
+				check(src[off + i] == (u8)((off + 9 + i) * 7 + 1));
+		}
+	}
+}
+
+/* Report how long `ROUNDS` runs of the code in between take. */
+#define BENCH(name, stmt)                                                   \
+	{                                                                   \
+		arch_dsb_sy();                                              \
+		i64 t = (i64)get_timestamp();                               \
+		for (int r = 0; r < ROUNDS; r++)                            \
+			stmt;                                               \
+		arch_dsb_sy();                                              \
+		t = (i64)get_timestamp() - t;                               \
+		printk("- %s: %lld ticks for %d pages, %lld MB/s\n", name, \
+		       t, ROUNDS,                                           \
+		       (i64)ROUNDS * PAGE_SIZE * f / t >> 20);              \
+	}
+
+/* Correctness check and page-sized benchmark of memcpy/memset/memmove. */
+void string_test()
+{
+	i64 f = get_clock_frequency();
+
+	printk("- string check...\n");
+	string_check();
+
+	BENCH("byte copy", byte_copy(dst, src, PAGE_SIZE));
+	BENCH("memcpy", memcpy(dst, src, PAGE_SIZE));
+	BENCH("memcpy unaligned", memcpy(dst + 1, src + 3, PAGE_SIZE));
+	BENCH("memmove", memmove(src + 8, src, PAGE_SIZE));
+	BENCH("memset", memset(dst, 0x5A, PAGE_SIZE));
+	BENCH("memset zero", memset(dst, 0, PAGE_SIZE));
+	printk("string_test PASS\n");
+}
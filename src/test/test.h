@@ -12,4 +12,6 @@ unsigned rand();
 void srand(unsigned seed);
 void sd_test();
 void pgfault_first_test();
-void pgfault_second_test();
\ No newline at end of file
+void pgfault_second_test();
+void string_test();
+void sem_test();
@@ -11,7 +11,7 @@ char *envp[] = { "TEST_ENV=FROM_INIT", 0 };
 
 int main()
 {
-	int pid, wpid;
+	int pid, wpid, fd;
 
 	if (open("console", O_RDWR) < 0) {
 		mknod("console", 1, 1);
@@ -20,6 +20,12 @@ int main()
 	dup(0); // stdout
 	dup(0); // stderr
 
+	// The scheduling statistics, for `cat schedstat`.
+	if ((fd = open("schedstat", O_RDONLY)) < 0)
+		mknod("schedstat", 2, 0);
+	else
+		close(fd);
+
 	while (1) {
 		pid = fork();
 		if (pid < 0) {
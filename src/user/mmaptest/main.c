@@ -13,12 +13,16 @@
 #define MAP_SHARED 0x01
 #define MAP_PRIVATE 0x02
 
+#define MS_SYNC 4
+
 #define PGSIZE 4096
 #define BSIZE 512
 #define O_CREATE O_CREAT
 
 void mmap_test();
 void fork_test();
+void sparse_test();
+int msync(void *addr, size_t length, int flags);
 char buf[BSIZE];
 
 #define MAP_FAILED ((char *)-1)
@@ -27,6 +31,7 @@ int main(int argc, char *argv[])
 {
 	mmap_test();
 	fork_test();
+	sparse_test();
 	printf("mmaptest: all tests succeeded\n");
 	exit(0);
 }
@@ -298,4 +303,85 @@ void fork_test(void)
 	_v1(p2);
 
 	printf("fork_test parent OK\n");
-}
\ No newline at end of file
+}
+
+//
+// map a file much larger than the part that is touched.
+// only the touched pages should be read in, and only the
+// written ones written back.
+//
+#define SPARSE_FILE_PAGES 16
+#define SPARSE_MAP_PAGES 64
+
+void sparse_test(void)
+{
+	int fd;
+	int i, j;
+	const char *const f = "mmap.sparse";
+
+	printf("sparse_test starting\n");
+	testname = "sparse_test";
+
+	// each page of the file is filled with its page number.
+	unlink(f);
+	if ((fd = open(f, O_RDWR | O_CREATE)) == -1)
+		err("open");
+	for (i = 0; i < SPARSE_FILE_PAGES; i++) {
+		memset(buf, i, BSIZE);
+		for (j = 0; j < PGSIZE / BSIZE; j++) {
+			if (write(fd, buf, BSIZE) != BSIZE)
+				err("write");
+		}
+	}
+
+	char *p = mmap(0, PGSIZE * SPARSE_MAP_PAGES, PROT_READ | PROT_WRITE,
+		       MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		err("mmap");
+	if (close(fd) == -1)
+		err("close");
+
+	// touch a few pages scattered over the file.
+	if (p[0] != 0 || p[PGSIZE * 5 + 5] != 5 ||
+	    p[PGSIZE * (SPARSE_FILE_PAGES - 1)] != SPARSE_FILE_PAGES - 1)
+		err("sparse mismatch");
+
+	// the part beyond the end of the file reads as zero.
+	if (p[PGSIZE * (SPARSE_MAP_PAGES - 1)] != 0)
+		err("sparse mismatch beyond eof");
+
+	// dirty two pages, one of them synced before the unmap.
+	p[PGSIZE * 5] = 'S';
+	if (msync(p + PGSIZE * 5, PGSIZE, MS_SYNC) == -1)
+		err("msync");
+	p[PGSIZE * 11] = 'U';
+
+	// writes beyond the end of the file must not grow it.
+	p[PGSIZE * (SPARSE_MAP_PAGES - 1)] = 'X';
+
+	if (munmap(p, PGSIZE * SPARSE_MAP_PAGES) == -1)
+		err("munmap");
+
+	if ((fd = open(f, O_RDONLY)) == -1)
+		err("open");
+	for (i = 0; i < SPARSE_FILE_PAGES; i++) {
+		for (j = 0; j < PGSIZE / BSIZE; j++) {
+			if (read(fd, buf, BSIZE) != BSIZE)
+				err("read");
+			char want = i;
+			if (j == 0 && i == 5)
+				want = 'S';
+			if (j == 0 && i == 11)
+				want = 'U';
+			if (buf[0] != want)
+				err("file does not contain modifications");
+		}
+	}
+	if (read(fd, buf, 1) != 0)
+		err("file grew");
+	if (close(fd) == -1)
+		err("close");
+	unlink(f);
+
+	printf("sparse_test OK\n");
+}
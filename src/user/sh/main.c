@@ -53,19 +53,22 @@ struct backcmd {
 };
 
 int fork1(void); // Fork but panics on failure.
+int simplecmd(char *);
 
 struct cmd *parsecmd(char *);
 
+#define MAXN 10000
+static size_t malloc1_used;
+
 void *malloc1(size_t sz)
 {
-#define MAXN 10000
 	static char mem[MAXN];
-	static size_t i;
-	if ((i += sz) > MAXN) {
+	size_t i = malloc1_used;
+	if ((malloc1_used += sz) > MAXN) {
 		fprintf(stderr, "malloc1: memory used out\n");
 		exit(1);
 	}
-	return &mem[i - sz];
+	return &mem[i];
 }
 
 void PANIC(char *s)
@@ -193,7 +196,26 @@ int main(int argc, char *argv[])
 				fprintf(stderr, "cannot cd %s\n", buf + 3);
 			continue;
 		}
-		if (fork1() == 0) {
+		// The commands are parsed afresh for every line.
+		malloc1_used = 0;
+		if (simplecmd(buf)) {
+			// A plain command is parsed here, so that the child only has
+			// to exec and can borrow our memory instead of copying it.
+			// The child runs on our stack, so it must not return from
+			// here or touch stdio: it only execs, or reports the failure
+			// with write and exits.
+			struct execcmd *ecmd = (struct execcmd *)parsecmd(buf);
+			int pid = vfork();
+			if (pid == 0) {
+				execv(ecmd->argv[0], ecmd->argv);
+				write(2, "exec ", 5);
+				write(2, ecmd->argv[0], strlen(ecmd->argv[0]));
+				write(2, " failed\n", 8);
+				_exit(127);
+			}
+			if (pid == -1)
+				PANIC("vfork");
+		} else if (fork1() == 0) {
 			runcmd(parsecmd(buf));
 		}
 		wait(NULL);
@@ -210,6 +232,30 @@ int fork1(void)
 	return pid;
 }
 
+char whitespace[] = " \t\r\n\v";
+char symbols[] = "<|>&;()";
+
+// Whether s is a single command with no redirections, pipes or lists, and
+// few enough arguments to always parse.
+int simplecmd(char *s)
+{
+	int argc = 0;
+
+	if (strpbrk(s, symbols))
+		return 0;
+	while (*s) {
+		while (*s && strchr(whitespace, *s))
+			s++;
+		if (*s == 0)
+			break;
+		if (++argc >= MAXARGS)
+			return 0;
+		while (*s && !strchr(whitespace, *s))
+			s++;
+	}
+	return argc > 0;
+}
+
 // Constructors
 
 struct cmd *execcmd(void)
@@ -275,9 +321,6 @@ struct cmd *backcmd(struct cmd *subcmd)
 
 // Parsing
 
-char whitespace[] = " \t\r\n\v";
-char symbols[] = "<|>&;()";
-
 int gettoken(char **ps, char *es, char **q, char **eq)
 {
 	char *s;
@@ -0,0 +1,174 @@
+#include <aarch64/intrinsic.h>
+#include <kernel/init.h>
+#include <kernel/param.h>
+#include <lib/bitmap.h>
+#include <lib/spinlock.h>
+#include <vm/asid.h>
+#include <vm/pgtbl.h>
+
+/*
+ * ASIDs are handed out from a bitmap. Once it is full, a new generation
+ * starts: the bitmap is cleared, and every core flushes its TLB before it
+ * switches to an address space again. The generation is kept in the bits of
+ * `vmspace.asid` above the ASID, so an address space can tell whether its
+ * ASID is still valid.
+ *
+ * The address space running on each core keeps its ASID across a rollover.
+ * Its ASID is moved to `reserved_asids`, and is taken again for the new
+ * generation at the next switch.
+ */
+
+static struct spinlock asid_lock;
+static u64 asid_generation = NUM_ASIDS;
+static Bitmap(asid_map, NUM_ASIDS);
+static u64 next_asid = 1;
+
+/* The ASID each core runs with, or 0 while a rollover is pending for it. */
+static u64 active_asids[NCPU];
+static u64 reserved_asids[NCPU];
+static bool flush_pending[NCPU];
+
+define_early_init(asid)
+{
+	init_spinlock(&asid_lock);
+	bitmap_set(asid_map, 0);
+}
+
+static bool asid_current(u64 asid)
+{
+	return asid != 0 &&
+	       (asid & ~ASID_MASK) ==
+		       __atomic_load_n(&asid_generation, __ATOMIC_RELAXED);
+}
+
+/* Start a new generation. The caller holds `asid_lock`. */
+static void asid_rollover()
+{
+	asid_generation += NUM_ASIDS;
+	for (usize i = 0; i < BITMAP_TO_NUM_CELLS(NUM_ASIDS); i++)
+		asid_map[i] = 0;
+	bitmap_set(asid_map, 0);
+
+	for (int i = 0; i < NCPU; i++) {
+		u64 asid = __atomic_exchange_n(&active_asids[i], 0,
+					       __ATOMIC_RELAXED);
+		// A core that has not switched since the last rollover still runs
+		// with its reserved ASID.
+		if (asid == 0)
+			asid = reserved_asids[i];
+		bitmap_set(asid_map, ASID(asid));
+		reserved_asids[i] = asid;
+		flush_pending[i] = true;
+	}
+	next_asid = 1;
+}
+
+/* Whether `asid` is reserved by some core. The caller holds `asid_lock`. */
+static bool asid_reserved(u64 asid)
+{
+	for (int i = 0; i < NCPU; i++) {
+		if (reserved_asids[i] == asid)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * If `asid` is reserved by some core, move it to the current generation. The
+ * caller holds `asid_lock`.
+ */
+static bool asid_update_reserved(u64 asid, u64 new_asid)
+{
+	bool hit = false;
+	for (int i = 0; i < NCPU; i++) {
+		if (reserved_asids[i] == asid) {
+			reserved_asids[i] = new_asid;
+			hit = true;
+		}
+	}
+	return hit;
+}
+
+/* Give `vs` an ASID of the current generation. The caller holds `asid_lock`. */
+static u64 asid_new(struct vmspace *vs)
+{
+	u64 asid = vs->asid;
+
+	if (asid != 0) {
+		u64 new_asid = asid_generation | ASID(asid);
+		if (asid_update_reserved(asid, new_asid))
+			return new_asid;
+
+		// Keep the same ASID if nobody has taken it in this generation.
+		if (!bitmap_get(asid_map, ASID(asid))) {
+			bitmap_set(asid_map, ASID(asid));
+			return new_asid;
+		}
+	}
+
+	for (int pass = 0; pass < 2; pass++) {
+		for (u64 i = next_asid; i < NUM_ASIDS; i++) {
+			if (!bitmap_get(asid_map, i)) {
+				bitmap_set(asid_map, i);
+				next_asid = i + 1;
+				return asid_generation | i;
+			}
+		}
+		asid_rollover();
+	}
+	PANIC();
+}
+
+/*
+ * Run `vs` on this core. Its TLB entries are tagged with its ASID, so no flush
+ * is needed unless its ASID is from an older generation.
+ */
+void switch_vmspace(struct vmspace *vs)
+{
+	int cpu = cpuid();
+	u64 asid = __atomic_load_n(&vs->asid, __ATOMIC_RELAXED);
+
+	// Fast path: the ASID is current and no rollover is in progress, which
+	// would have cleared `active_asids`.
+	u64 old_active = __atomic_load_n(&active_asids[cpu], __ATOMIC_RELAXED);
+	if (old_active != 0 && asid_current(asid) &&
+	    __atomic_compare_exchange_n(&active_asids[cpu], &old_active, asid,
+					false, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+		goto switch_ttbr0;
+
+	acquire_spinlock(&asid_lock);
+	asid = vs->asid;
+	if (!asid_current(asid)) {
+		asid = asid_new(vs);
+		__atomic_store_n(&vs->asid, asid, __ATOMIC_RELAXED);
+	}
+	if (flush_pending[cpu]) {
+		arch_tlbi_vmalle1();
+		flush_pending[cpu] = false;
+	}
+	__atomic_store_n(&active_asids[cpu], asid, __ATOMIC_RELAXED);
+	release_spinlock(&asid_lock);
+
+switch_ttbr0:
+	arch_set_ttbr0_asid((u64)vs->pgtbl, ASID(asid));
+}
+
+/*
+ * Release the ASID of `vs`, which is no longer used by any core. Its TLB
+ * entries are flushed, so the ASID can be handed out again right away.
+ */
+void asid_free(struct vmspace *vs)
+{
+	u64 asid = vs->asid;
+	if (asid == 0)
+		return;
+
+	arch_tlbi_aside1is(ASID(asid));
+
+	acquire_spinlock(&asid_lock);
+	if (asid_current(asid) && !asid_reserved(asid))
+		bitmap_clear(asid_map, ASID(asid));
+	release_spinlock(&asid_lock);
+	vs->asid = 0;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <lib/defines.h>
+
+/*
+ * TCR_EL1.AS is clear, so ASIDs have 8 bits. ASID 0 is never given to a user
+ * address space, so that the kernel can use it with an empty TTBR0.
+ */
+#define ASID_BITS 8
+#define NUM_ASIDS (1 << ASID_BITS)
+#define ASID_MASK ((u64)NUM_ASIDS - 1)
+
+/* The ASID in the value of `vmspace.asid`, which also holds a generation. */
+#define ASID(asid) ((asid) & ASID_MASK)
+
+struct vmspace;
+
+void switch_vmspace(struct vmspace *vs);
+void asid_free(struct vmspace *vs);
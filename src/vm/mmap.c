@@ -3,21 +3,16 @@
 #include <vm/vmregion.h>
 #include <vm/pgtbl.h>
 #include <kernel/mem.h>
+#include <fs/file.h>
 #include <lib/printk.h>
 #include <lib/string.h>
 
 static void *mmap_get_addr(void *addr, int length, struct vmspace *vs)
 {
 	if (addr == 0) {
-		u64 start = 0;
-		list_forall(pv, vs->vmregions)
-		{
-			struct vmregion *vmr =
-				container_of(pv, struct vmregion, stnode);
-			if (!(vmr->flags & VMR_STACK) && (vmr->end > start))
-				start = vmr->end;
-		}
-		return (void *)round_up((u64)start, PAGE_SIZE);
+		// Mappings start well above the heap to leave it room to grow.
+		return (void *)vmregion_find_gap(vs, MMAP_BASE,
+						 round_up(length, PAGE_SIZE));
 	} else {
 		/**
          * WARNING: the addr is rounded up to make the start address of the 
@@ -35,23 +30,107 @@ static void *mmap_get_addr(void *addr, int length, struct vmspace *vs)
 	}
 }
 
+/*
+ * Map the pages of the file backing `v` within [begin, end) straight from the
+ * page cache. The pages are mapped read-only: a private mapping copies a page
+ * on the first write, and a shared one makes it writable and marks it dirty
+ * (see `mmap_sync`).
+ */
+int mmap_populate(struct vmspace *vs, struct vmregion *v, u64 begin, u64 end)
+{
+	struct inode *ip = v->mmap_info.fp->ip;
+
+	inodes.lock(ip);
+	for (u64 va = PAGE_BASE(begin); va < end; va += PAGE_SIZE) {
+		usize offset = v->mmap_info.offset + (va - v->begin);
+		void *page = page_cache_get(ip, offset / PAGE_SIZE);
+		if (page == NULL) {
+			inodes.unlock(ip);
+			return -1;
+		}
+		map_in_pgtbl(vs->pgtbl, va, page, PTE_USER_DATA | PTE_RO);
+	}
+	inodes.unlock(ip);
+	return 0;
+}
+
+/*
+ * Write the dirty pages of the shared mapping `v` within [begin, end) back to
+ * the file. A page of a shared mapping is marked dirty when it is made
+ * writable, and it is made clean and read-only again once written. Nothing
+ * past the end of the file is written, so that the file does not grow.
+ *
+ * The PTEs may be in a page table shared with a child by `fork`. Changing
+ * them in place is fine, since the child maps the same page of the file.
+ */
+void mmap_sync(struct vmspace *vs, struct vmregion *v, u64 begin, u64 end)
+{
+	struct inode *ip = v->mmap_info.fp->ip;
+	struct tlb_gather tlb;
+
+	if (!(v->flags & VMR_MM) || !(v->mmap_info.flags & MAP_SHARED))
+		return;
+
+	tlb_gather_init(&tlb, vs);
+
+	for (u64 va = PAGE_BASE(begin); va < end; va += PAGE_SIZE) {
+		pgtbl_entry_t *pte = get_pte(vs->pgtbl, va, false);
+		if (!pte || !(*pte & PTE_VALID) || !(*pte & PTE_DIRTY))
+			continue;
+
+		// Each page is written in its own transaction to keep it within the
+		// size of the log.
+		struct op_ctx ctx;
+		bcache.begin_op(&ctx);
+		inodes.lock(ip);
+		usize offset = v->mmap_info.offset + (va - v->begin);
+		if (offset < ip->entry.num_bytes) {
+			usize n = MIN((usize)PAGE_SIZE,
+				      ip->entry.num_bytes - offset);
+			inodes.write(&ctx, ip, (u8 *)P2K(PTE_ADDRESS(*pte)),
+				     offset, n);
+		}
+		*pte = (*pte | PTE_RO) & ~PTE_DIRTY;
+		tlb_gather_page(&tlb, va);
+		inodes.unlock(ip);
+		bcache.end_op(&ctx);
+	}
+	tlb_finish(&tlb);
+}
+
+/* Write back all shared mappings in `vs`. */
+void mmap_sync_all(struct vmspace *vs)
+{
+	vmregion_forall(vs, v)
+	{
+		mmap_sync(vs, v, v->begin, v->end);
+	}
+}
+
 u64 mmap(void *addr, int length, int prot, int flags, int fd, usize offset)
 {
 	struct proc *p = thisproc();
+
+	if (fd < 0 || fd >= NOFILE || length <= 0 || offset % PAGE_SIZE != 0)
+		return -1;
+
 	struct file *f = p->oftable.ofiles[fd];
+	if (f == NULL || f->type != FD_INODE ||
+	    f->ip->entry.type == INODE_DEVICE)
+		return -1;
 
 	if ((prot & PROT_WRITE) && (!f->writable && !(flags & MAP_PRIVATE)))
 		return -1;
 	if ((prot & PROT_READ) && !f->readable)
 		return -1;
 
-	// int pte_flag = PTE_USER_DATA;
-
 	struct vmregion *v = kalloc(sizeof(struct vmregion));
 	v->flags = VMR_MM;
+	if (!(prot & PROT_WRITE))
+		v->flags |= VMR_RO;
 	v->mmap_info.flags = flags;
 	v->mmap_info.offset = offset;
-	v->mmap_info.fp = file_dup(f);
+	v->mmap_info.filesz = length;
 	v->mmap_info.prot = prot;
 
 	v->begin = (u64)mmap_get_addr(addr, length, &p->vmspace);
@@ -60,36 +139,17 @@ u64 mmap(void *addr, int length, int prot, int flags, int fd, usize offset)
 	if (v->begin == 0)
 		goto bad;
 
-	list_push_back(&p->vmspace.vmregions, &v->stnode);
+	v->mmap_info.fp = file_dup(f);
+	insert_vmregion(&p->vmspace, v);
 
-	for (u64 i = v->begin; i < v->end; i += PAGE_SIZE) {
-		pgtbl_entry_t *pte = get_pte(p->vmspace.pgtbl, i, true);
-		if (pte == NULL)
-			goto bad;
-		*pte &= ~PTE_VALID;
-	}
 #ifndef MMAP_LAZY
-	int pte_flag = PTE_USER_DATA;
-
-	if (v->mmap_info.prot & PROT_READ)
-		pte_flag |= PTE_RO;
-
-	for (u64 i = v->begin; i < v->end; i += PAGE_SIZE)
-		map_in_pgtbl(p->vmspace.pgtbl, i, kalloc_page(), PTE_USER_DATA);
-
-	char *buf = (char *)kalloc_page();
-
-	inodes.lock(f->ip);
-	for (int i = 0; i < length; i += PAGE_SIZE) {
-		memset(buf, 0, PAGE_SIZE);
-		inodes.read(f->ip, (u8 *)buf, offset, PAGE_SIZE);
-		copy_to_user(p->vmspace.pgtbl, (void *)(v->begin + i), (void *)buf,
-			     MAX((usize)PAGE_SIZE, length - offset));
-		offset += PAGE_SIZE;
+	if (mmap_populate(&p->vmspace, v, v->begin, v->end) < 0) {
+		unmap_range_in_pgtbl(p->vmspace.pgtbl, v->begin, v->end);
+		tlb_flush_range(&p->vmspace, v->begin, v->end);
+		remove_vmregion(&p->vmspace, v);
+		file_close(v->mmap_info.fp);
+		goto bad;
 	}
-	inodes.unlock(f->ip);
-
-	kfree_page((void *)buf);
 #endif
 
 	return v->begin;
@@ -99,48 +159,71 @@ bad:
 	return -1;
 }
 
+/* Find the mapping created by `mmap` that contains `addr`. */
+static struct vmregion *mmap_find(struct vmspace *vs, u64 addr)
+{
+	struct vmregion *vmr = vmregion_find(vs, addr);
+	return vmr && (vmr->flags & VMR_MM) ? vmr : NULL;
+}
+
+/*
+ * Unmap [addr, addr + length) from a mapping. Only the whole mapping, or a
+ * range at either end of it, can be unmapped.
+ */
 int munmap(void *addr, usize length)
 {
-	struct vmregion *v = NULL;
 	struct proc *p = thisproc();
+	struct vmspace *vs = &p->vmspace;
+	u64 begin = (u64)addr;
+	u64 end = begin + round_up(length, PAGE_SIZE);
 
-	list_forall(pv, p->vmspace.vmregions)
-	{
-		struct vmregion *vmr =
-			container_of(pv, struct vmregion, stnode);
-		if (vmr->begin <= (u64)addr && (u64)addr < vmr->end) {
-			v = vmr;
-			break;
-		}
-	}
+	if (begin % PAGE_SIZE != 0 || length == 0)
+		return -1;
 
+	struct vmregion *v = mmap_find(vs, begin);
 	if (v == NULL)
 		return -1;
 
-	if (length < (v->end - v->begin))
-		v->begin = (u64)addr + length;
-	else if (length == (v->end - v->begin))
-		list_remove(&p->vmspace.vmregions, &v->stnode);
-	else
+	end = MIN(end, v->end);
+	if (begin != v->begin && end != v->end)
 		return -1;
 
-	if ((v->mmap_info.flags & MAP_SHARED)) {
-		struct op_ctx ctx;
-		bcache.begin_op(&ctx);
-		inodes.lock(v->mmap_info.fp->ip);
-		inodes.write(&ctx, v->mmap_info.fp->ip, (u8 *)addr,
-			     v->mmap_info.offset, length);
-		inodes.unlock(v->mmap_info.fp->ip);
-		bcache.end_op(&ctx);
-	} else {
-		unmap_range_in_pgtbl(p->vmspace.pgtbl, (u64)addr,
-				     (u64)addr + length);
-	}
+	mmap_sync(vs, v, begin, end);
+	unmap_range_in_pgtbl(vs->pgtbl, begin, end);
+	tlb_flush_range(vs, begin, end);
 
-	if (length == (v->end - v->begin)) {
+	if (begin == v->begin && end == v->end) {
+		remove_vmregion(vs, v);
 		file_close(v->mmap_info.fp);
 		kfree(v);
+	} else if (begin == v->begin) {
+		// The rest of the mapping now starts further into the file.
+		v->mmap_info.offset += end - begin;
+		v->mmap_info.filesz -= end - begin;
+		resize_vmregion(v, end, v->end);
+	} else {
+		v->mmap_info.filesz -= end - begin;
+		resize_vmregion(v, v->begin, begin);
 	}
 
 	return 0;
-}
\ No newline at end of file
+}
+
+int msync(void *addr, usize length)
+{
+	struct vmspace *vs = &thisproc()->vmspace;
+	u64 begin = (u64)addr;
+	u64 end = begin + length;
+
+	if (begin % PAGE_SIZE != 0)
+		return -1;
+
+	while (begin < end) {
+		struct vmregion *v = mmap_find(vs, begin);
+		if (v == NULL)
+			return -1;
+		mmap_sync(vs, v, begin, MIN(end, v->end));
+		begin = v->end;
+	}
+	return 0;
+}
@@ -1,3 +1,7 @@
+#pragma once
+
+#include <lib/defines.h>
+
 #define PROT_NONE 0x0
 #define PROT_READ 0x1
 #define PROT_WRITE 0x2
@@ -6,5 +10,12 @@
 #define MAP_SHARED 0x01
 #define MAP_PRIVATE 0x02
 
+struct vmspace;
+struct vmregion;
+
+int mmap_populate(struct vmspace *vs, struct vmregion *v, u64 begin, u64 end);
 u64 mmap(void *addr, int length, int prot, int flags, int fd, usize offset);
-int munmap(void *addr, usize length);
\ No newline at end of file
+void mmap_sync(struct vmspace *vs, struct vmregion *v, u64 begin, u64 end);
+void mmap_sync_all(struct vmspace *vs);
+int munmap(void *addr, usize length);
+int msync(void *addr, usize length);
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <aarch64/mmu.h>
+#include <aarch64/trap.h>
 #include <kernel/mem.h>
 #include <lib/string.h>
 #include <proc/sched.h>
@@ -6,82 +7,271 @@
 #include <vm/mmap.h>
 #include <kernel/param.h>
 
-void handle_copy_on_write(pgtbl_entry_t *pte, struct vmspace *vs, u64 addr)
+/*
+ * A fault also handles the neighbouring pages within an aligned window of this
+ * many pages, which never crosses a last-level page table.
+ */
+#define FAULT_AROUND_PAGES 16
+
+/* Get the window of neighbouring pages of `addr` within `v`. */
+static void fault_around_window(struct vmregion *v, u64 addr, u64 *begin,
+				u64 *end)
+{
+	u64 window = FAULT_AROUND_PAGES * PAGE_SIZE;
+	*begin = MAX(addr & ~(window - 1), PAGE_BASE(v->begin));
+	*end = MIN((addr & ~(window - 1)) + window, v->end);
+}
+
+/* Whether the page at `ka` is mapped nowhere else. */
+static bool page_exclusive(void *ka)
+{
+	struct page *page = get_page_info_by_kaddr(ka);
+	return page && page->ref.count == 1;
+}
+
+/*
+ * Make the read-only page at `addr` writable. The last owner of a page takes
+ * it over in place, and everyone else gets a copy. Since `fork` leaves all
+ * pages of a range read-only, the other exclusive pages in the window are made
+ * writable too, saving their faults.
+ */
+void handle_copy_on_write(pgtbl_entry_t *pte, struct vmspace *vs,
+			  struct vmregion *v, u64 addr)
 {
 	void *target_page = (void *)P2K(PTE_ADDRESS(*pte));
-	void *new_page = kalloc_page();
-	memcpy(new_page, target_page, PAGE_SIZE);
-	map_in_pgtbl(vs->pgtbl, addr, new_page, PTE_FLAGS(*pte) & (~PTE_RO));
-	return;
+
+	if (page_exclusive(target_page)) {
+		*pte &= ~PTE_RO;
+	} else {
+		void *new_page = kalloc_page();
+		memcpy(new_page, target_page, PAGE_SIZE);
+		map_in_pgtbl(vs->pgtbl, addr, new_page,
+			     PTE_FLAGS(*pte) & (~PTE_RO));
+	}
+
+	// Relaxing permissions needs no TLB flush. A stale entry only causes a
+	// spurious fault.
+	u64 begin, end;
+	fault_around_window(v, addr, &begin, &end);
+	for (u64 va = begin; va < end; va += PAGE_SIZE) {
+		pgtbl_entry_t *p = get_pte(vs->pgtbl, va, false);
+		if (p && (*p & PTE_VALID) && (*p & PTE_RO) &&
+		    page_exclusive((void *)P2K(PTE_ADDRESS(*p))))
+			*p &= ~PTE_RO;
+	}
 }
 
-#ifdef MMAP_LAZY
-void handle_memory_map(u64 begin, u64 end, struct vmspace *vs, u64 offset,
-		       struct file *f, int prot)
+/*
+ * Map the pages of the file-backed region `v` around `addr` that are already
+ * in the page cache, read-only. Pages that are not cached are left to their
+ * own faults rather than read in now. The caller holds the lock of the inode.
+ */
+static void fault_around_file(struct vmregion *v, struct vmspace *vs, u64 addr)
 {
-	int pte_flag = PTE_USER_DATA;
+	struct mmap_info *m = &v->mmap_info;
+	u64 file_end = v->begin + m->filesz;
+	u64 begin, end;
 
-	if (prot & PROT_READ)
-		pte_flag |= PTE_RO;
+	fault_around_window(v, addr, &begin, &end);
+	for (u64 va = begin; va < end; va += PAGE_SIZE) {
+		// The page holding the end of the file may need a private copy.
+		if (va == PAGE_BASE(addr) || va + PAGE_SIZE > file_end)
+			continue;
 
-	int length = end - begin;
-	for (u64 i = begin; i < end; i += PAGE_SIZE)
-		map_in_pgtbl(vs->pgtbl, i, kalloc_page(), PTE_USER_DATA);
+		pgtbl_entry_t *pte = get_pte(vs->pgtbl, va, false);
+		if (pte && (*pte & PTE_VALID))
+			continue;
 
-	char *buf = (char *)kalloc_page();
+		usize offset = m->offset + (va - v->begin);
+		void *page = page_cache_lookup(m->fp->ip, offset / PAGE_SIZE);
+		if (page)
+			map_in_pgtbl(vs->pgtbl, va, page,
+				     PTE_USER_DATA | PTE_RO);
+	}
+}
+
+/*
+ * Map the page at `addr` in the file-backed region `v` from the page cache of
+ * the file. The page is shared read-only, and a private region copies it on
+ * the first write. The page holding the end of the file content is copied
+ * right away if the region goes on beyond it, since the rest of the page must
+ * read as zero.
+ *
+ * Segments that are not page-aligned to the file cannot use the page cache.
+ * Their pages are read into private pages instead.
+ */
+static void handle_file_backed(struct vmregion *v, struct vmspace *vs,
+			       u64 addr, bool write)
+{
+	struct mmap_info *m = &v->mmap_info;
+	struct inode *ip = m->fp->ip;
+	u64 va = PAGE_BASE(addr);
+	u64 file_end = v->begin + m->filesz;
+	bool shared = m->flags & MAP_SHARED;
+	u64 private_flags = PTE_USER_DATA | ((v->flags & VMR_RO) ? PTE_RO : 0);
+
+	inodes.lock(ip);
 
-	inodes.lock(f->ip);
-	for (int i = 0; i < length; i += PAGE_SIZE) {
-		memset(buf, 0, PAGE_SIZE);
-		inodes.read(f->ip, (u8 *)buf, offset, PAGE_SIZE);
-		copy_to_user(vs->pgtbl, (void *)(begin + i), (void *)buf,
-			     MAX((usize)PAGE_SIZE, length - offset));
-		offset += PAGE_SIZE;
+	if ((m->offset - v->begin) % PAGE_SIZE != 0) {
+		void *copy = kalloc_page();
+		memset(copy, 0, PAGE_SIZE);
+		u64 from = MAX(va, v->begin);
+		u64 to = MIN(va + PAGE_SIZE, file_end);
+		inodes.read(ip, copy + (from - va), m->offset + (from - v->begin),
+			    to - from);
+		map_in_pgtbl(vs->pgtbl, va, copy, private_flags);
+		inodes.unlock(ip);
+		return;
 	}
-	inodes.unlock(f->ip);
 
-	kfree_page((void *)buf);
+	// The region is page-aligned to the file, so this is a page boundary. The
+	// first page may start before the region, which is fine with u64.
+	usize offset = m->offset + (va - v->begin);
+	void *page = page_cache_get(ip, offset / PAGE_SIZE);
+	if (page == NULL) {
+		inodes.unlock(ip);
+		return;
+	}
+
+	if (!shared && (write || (va + PAGE_SIZE > file_end &&
+				  v->end > file_end))) {
+		void *copy = kalloc_page();
+		usize n = MIN((u64)PAGE_SIZE, file_end - va);
+		memcpy(copy, page, n);
+		memset(copy + n, 0, PAGE_SIZE - n);
+		map_in_pgtbl(vs->pgtbl, va, copy, private_flags);
+	} else {
+		// A shared page is only mapped writable by a write, which marks it
+		// dirty for `mmap_sync`.
+		bool writable = shared && (m->prot & PROT_WRITE) && write;
+		map_in_pgtbl(vs->pgtbl, va, page,
+			     PTE_USER_DATA | (writable ? PTE_DIRTY : PTE_RO));
+		fault_around_file(v, vs, addr);
+	}
+	inodes.unlock(ip);
 }
-#endif
 
+/*
+ * Map a zero-filled huge page over the 2 MiB range around `addr`, if the range
+ * lies within the zero-filled part of `v` and nothing has been mapped in it
+ * yet. Large heaps and stacks then take one TLB entry per 2 MiB.
+ */
+static bool handle_huge_zero(struct vmregion *v, struct vmspace *vs, u64 addr)
+{
+	u64 begin = addr & ~(u64)(HUGE_PAGE_SIZE - 1);
+	u64 zero_begin = v->begin;
+
+	if (v->mmap_info.fp)
+		zero_begin = PAGE_BASE(v->begin + v->mmap_info.filesz +
+				       PAGE_SIZE - 1);
+	if (begin < zero_begin || begin + HUGE_PAGE_SIZE > v->end ||
+	    !huge_range_free(vs->pgtbl, begin))
+		return false;
+
+	void *page = kalloc_huge_page();
+	if (page == NULL)
+		return false;
+	memset(page, 0, HUGE_PAGE_SIZE);
+	if (!map_huge_in_pgtbl(vs->pgtbl, begin, page, PTE_USER_BLOCK)) {
+		kfree_huge_page(page);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Map a zero-filled page at `addr`. A read maps the shared zero page, which is
+ * copied by the next write like any other copy-on-write page. A write maps a
+ * huge page if it can.
+ */
+static void handle_demand_zero(struct vmregion *v, struct vmspace *vs,
+			       u64 addr, bool write)
+{
+	u64 va = PAGE_BASE(addr);
+
+	if (!write || (v->flags & VMR_RO)) {
+		map_in_pgtbl(vs->pgtbl, va, get_zero_page(),
+			     PTE_USER_DATA | PTE_RO);
+		return;
+	}
+
+	if (handle_huge_zero(v, vs, addr))
+		return;
+
+	void *page = kalloc_page();
+	memset(page, 0, PAGE_SIZE);
+	map_in_pgtbl(vs->pgtbl, va, page, PTE_USER_DATA);
+}
+
+/*
+ * Resolve a fault on a user address of the current process. Returns -1 if the
+ * address is not mapped or the access is not allowed, which the caller turns
+ * into a fixup or the death of the process.
+ */
 int pgfault_handler(u64 iss)
 {
-	(void)iss;
 	struct proc *p = thisproc();
 	struct vmspace *vs = &p->vmspace;
 	u64 addr = arch_get_far(); // The address which caused the page fault.
+	bool write = iss & ISS_WNR; // Whether the fault is caused by a write.
+
+	struct vmregion *v = vmregion_find(vs, addr);
+	if (v == NULL)
+		return -1;
+
+	bool vmr_read_only = (v->flags & VMR_RO);
+	if (write && vmr_read_only)
+		return -1;
+
 	pgtbl_entry_t *pte = get_pte(vs->pgtbl, addr, false);
+	// Huge pages are mapped writable, so a fault in one is spurious.
+	if (!pte && huge_mapped(vs->pgtbl, addr))
+		return 0;
+	bool page_present = pte && (*pte & PTE_VALID);
+	// A write to a present page needs the page table to be private. See
+	// `unshare_pte_table`. Missing tables are left missing, so that a huge
+	// page can still be mapped.
+	if (write && !vmr_read_only && page_present)
+		pte = get_pte(vs->pgtbl, addr, true);
+	bool page_read_only = page_present && (*pte & PTE_RO);
+	bool is_vmr_mm = v->flags & VMR_MM;
+
+	// Copy on Write. The pages of a shared file mapping are the pages in the
+	// page cache, so they only need to be made writable, which marks them
+	// dirty.
+	if (!vmr_read_only && page_read_only) {
+		if (is_vmr_mm && (v->mmap_info.flags & MAP_SHARED))
+			map_in_pgtbl(vs->pgtbl, PAGE_BASE(addr),
+				     (void *)P2K(PTE_ADDRESS(*pte)),
+				     (PTE_FLAGS(*pte) & ~PTE_RO) | PTE_DIRTY);
+		else
+			handle_copy_on_write(pte, vs, v, addr);
+		tlb_flush_page(vs, addr);
+		goto finished;
+	}
+
+	// The TLB still holds the read-only entry of a page whose page table has
+	// just been made private.
+	if (write && page_present && !page_read_only) {
+		tlb_flush_page(vs, addr);
+		goto finished;
+	}
+
+	// Executable segments and memory mapped files.
+	if (v->mmap_info.fp && !page_present &&
+	    PAGE_BASE(addr) < v->begin + v->mmap_info.filesz) {
+		handle_file_backed(v, vs, addr, write);
+		goto finished;
+	}
 
-	list_forall(p, vs->vmregions)
-	{
-		struct vmregion *v = container_of(p, struct vmregion, stnode);
-		if (v->begin <= addr && addr < v->end) {
-			bool vmr_read_only = (v->flags & VMR_RO);
-			bool page_read_only = (PTE_FLAGS(*pte) & PTE_RO);
-			bool is_vmr_mm = v->flags & VMR_MM;
-
-			// Copy on Write.
-			if (!vmr_read_only && page_read_only) {
-				handle_copy_on_write(pte, vs, addr);
-				goto finished;
-			}
-
-			// Memory mapped files.
-			if (is_vmr_mm) {
-#ifdef MMAP_LAZY
-				handle_memory_map(v->begin, v->end, vs,
-						  v->mmap_info.offset,
-						  v->mmap_info.fp,
-						  v->mmap_info.prot);
-#endif
-				goto finished;
-			}
-		}
+	// Bss, heap and stack.
+	if (!page_present) {
+		handle_demand_zero(v, vs, addr, write);
+		goto finished;
 	}
 
 finished:
-	// We have modified the page table. Therefore, we should flush TLB to ensure
-	// consistency.
-	arch_tlbi_vmalle1is();
+	// Only the pages replaced above need to be flushed from the TLB. The TLB
+	// never caches the invalid PTEs that the other cases fill in.
 	return 0;
 }
\ No newline at end of file
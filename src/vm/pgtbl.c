@@ -3,20 +3,134 @@
 #include <lib/printk.h>
 #include <lib/string.h>
 #include <proc/sched.h>
+#include <vm/asid.h>
 #include <vm/vmregion.h>
 #include <vm/pgtbl.h>
 
 void detach_mapped_page(pgtbl_entry_t *pte)
 {
-	u64 page_addr_k = (u64)P2K(PTE_ADDRESS(*pte));
-	struct page *page_mapped = get_page_info_by_kaddr((void *)page_addr_k);
-	if (page_mapped) {
-		decrement_rc(&page_mapped->ref);
-		if (page_mapped->ref.count == 0)
-			kfree_page((void *)page_addr_k);
+	put_page((void *)P2K(PTE_ADDRESS(*pte)));
+}
+
+/*
+ * Drop a reference to the last-level table `table`. The pages it maps are
+ * detached when the last reference is gone.
+ */
+static void put_pte_table(pgtbl_entry_t *table)
+{
+	if (!decrement_rc(&get_page_info_by_kaddr(table)->ref))
+		return;
+
+	for (int i = 0; i < N_PTE_PER_TABLE; i++) {
+		if (table[i] & PTE_VALID)
+			detach_mapped_page(&table[i]);
+	}
+	kfree_page(table);
+}
+
+/*
+ * Make the last-level table referenced by the level-2 entry `pde` private, so
+ * that its PTEs can be changed. `fork` shares such tables read-only between
+ * the parent and the child (see `share_pgtbl`).
+ *
+ * If the table is still shared, it is copied. Every page it maps then gets one
+ * more reference and is write-protected in both copies, so the pages are
+ * copied on write from now on. `va` is an address in the range of `pde`.
+ */
+static void unshare_pte_table(pgtbl_entry_t *pde, u64 va)
+{
+	pgtbl_entry_t *table = (pgtbl_entry_t *)P2K(PTE_ADDRESS(*pde));
+
+	if (get_page_info_by_kaddr(table)->ref.count > 1) {
+		pgtbl_entry_t *copy = share_page(kalloc_page());
+		for (int i = 0; i < N_PTE_PER_TABLE; i++) {
+			if (table[i] & PTE_VALID) {
+				table[i] |= PTE_RO;
+				share_page((void *)P2K(PTE_ADDRESS(table[i])));
+			}
+			copy[i] = table[i];
+		}
+		*pde = K2P(copy) | PTE_TABLE;
+		put_pte_table(table);
+	} else {
+		*pde &= ~PTE_TABLE_RO;
+	}
+
+	// The TLB may still cache the old level-2 entry for walks in this range.
+	// Invalidating any address in the range drops it.
+	arch_tlbi_begin();
+	arch_tlbi_vaae1is(va);
+	arch_tlbi_end();
+}
+
+/*
+ * Get the pointer to the level-2 entry of `va` in `pt`. With `alloc`, the
+ * tables above it are allocated as needed. Without `alloc`, NULL is returned
+ * if they are missing.
+ */
+static pgtbl_entry_t *get_pde(pgtbl_entry_t *pt, u64 va, bool alloc)
+{
+	pgtbl_entry_t *pgtbl = (pgtbl_entry_t *)P2K(pt);
+	int idxs[] = { VA_PART0(va), VA_PART1(va) };
+
+	for (int i = 0; i < 2; i++) {
+		if (!(pgtbl[idxs[i]] & PTE_VALID)) {
+			if (!alloc)
+				return NULL;
+			void *table = kalloc_page();
+			memset(table, 0, PAGE_SIZE);
+			pgtbl[idxs[i]] = K2P(table) | PTE_TABLE;
+		}
+		pgtbl = (pgtbl_entry_t *)P2K(PTE_ADDRESS(pgtbl[idxs[i]]));
 	}
+
+	return pgtbl + VA_PART2(va);
+}
+
+/* Whether the level-2 entry `pde` maps a huge page rather than a table. */
+static bool is_huge_pde(pgtbl_entry_t pde)
+{
+	return (pde & PTE_TABLE) == PTE_BLOCK;
 }
 
+/*
+ * Split the huge page mapped by the level-2 entry `pde` into 4 KiB pages of a
+ * new last-level table, with the same attributes. Each page then has its own
+ * reference, so that it can be unmapped, copied on write or freed alone. `va`
+ * is an address in the range of `pde`.
+ */
+static void split_huge_pde(pgtbl_entry_t *pde, u64 va)
+{
+	u64 block = P2K(PTE_ADDRESS(*pde));
+	u64 flags = (PTE_FLAGS(*pde) & ~(u64)PTE_TABLE) | PTE_PAGE;
+	pgtbl_entry_t *table = share_page(kalloc_page());
+
+	// The first page already holds the reference of the block.
+	for (int i = 0; i < N_PTE_PER_TABLE; i++) {
+		void *page = (void *)(block + i * PAGE_SIZE);
+		if (i > 0)
+			share_page(page);
+		table[i] = K2P(page) | flags;
+	}
+
+	// Break before make: the block entry must be gone from the TLB before the
+	// table replaces it. Invalidating any address in the range drops it.
+	*pde = 0;
+	arch_tlbi_begin();
+	arch_tlbi_vaae1is(va);
+	arch_tlbi_end();
+	*pde = K2P(table) | PTE_TABLE;
+}
+
+/*
+ * Get the pointer to the PTE of `va` in `pt`. With `alloc`, the missing tables
+ * are allocated, and the last-level table is made private to `pt`, so the PTE
+ * can be written. Without `alloc`, the PTE may be in a table shared with
+ * another page table and must only be read.
+ *
+ * A huge page has no PTE of its own. With `alloc`, it is split; without,
+ * NULL is returned for it (see `huge_mapped`).
+ */
 pgtbl_entry_t *get_pte(pgtbl_entry_t *pt, u64 va, bool alloc)
 {
 	if (!pt && !alloc)
@@ -31,9 +145,6 @@ pgtbl_entry_t *get_pte(pgtbl_entry_t *pt, u64 va, bool alloc)
 	// The 4 parts of the virtual address.
 	int idxs[] = { VA_PART0(va), VA_PART1(va), VA_PART2(va), VA_PART3(va) };
 
-	// The flags with respect to the four levels in page table.
-	u32 flags[] = { PTE_TABLE, PTE_TABLE, PTE_TABLE, PTE_USER_DATA };
-
 	int i = 0;
 
 	while (i < 3) {
@@ -41,11 +152,20 @@ pgtbl_entry_t *get_pte(pgtbl_entry_t *pt, u64 va, bool alloc)
 		if (!(pgtbl[idxs[i]] & PTE_VALID)) {
 			if (!alloc)
 				return NULL;
-			if (alloc) {
-				pgtbl[idxs[i]] = K2P(kalloc_page()) | flags[i];
-				memset((void *)P2K(PTE_ADDRESS(pgtbl[idxs[i]])),
-				       0, PAGE_SIZE);
-			}
+			void *table = kalloc_page();
+			memset(table, 0, PAGE_SIZE);
+
+			// Last-level tables are reference counted, since `fork` shares
+			// them.
+			if (i == 2)
+				share_page(table);
+			pgtbl[idxs[i]] = K2P(table) | PTE_TABLE;
+		} else if (i == 2 && is_huge_pde(pgtbl[idxs[i]])) {
+			if (!alloc)
+				return NULL;
+			split_huge_pde(&pgtbl[idxs[i]], va);
+		} else if (i == 2 && alloc && (pgtbl[idxs[i]] & PTE_TABLE_RO)) {
+			unshare_pte_table(&pgtbl[idxs[i]], va);
 		}
 		pgtbl = (pgtbl_entry_t *)P2K(PTE_ADDRESS(pgtbl[idxs[i]]));
 		i++;
@@ -62,16 +182,19 @@ void __free_page_table_level(pgtbl_entry_t *p_pte_page, u8 level)
 	pgtbl_entry_t *p_pte_base =
 		(pgtbl_entry_t *)P2K(PTE_ADDRESS(*p_pte_page));
 
-	// Iterate over each PTE in the table.
+	// A last-level table may be shared with other page tables.
+	if (level == 3) {
+		put_pte_table(p_pte_base);
+		return;
+	}
+
+	// Iterate over each PTE in the table and free the next level.
 	for (int i = 0; i < N_PTE_PER_TABLE; i++) {
 		pgtbl_entry_t *p_pte = p_pte_base + i;
 		if (!(*p_pte & PTE_VALID))
 			continue;
-
-		// If at the last level, detach the mapped page.
-		// Otherwise, recursively free the next level.
-		if (level == 3)
-			detach_mapped_page(p_pte);
+		if (level == 2 && is_huge_pde(*p_pte))
+			put_huge_page((void *)P2K(PTE_ADDRESS(*p_pte)));
 		else
 			__free_page_table_level(p_pte, level + 1);
 	}
@@ -83,11 +206,65 @@ void __free_page_table_level(pgtbl_entry_t *p_pte_page, u8 level)
 void free_page_table(pgtbl_entry_t **pt)
 {
 	ASSERT(*pt != NULL);
+
+	// This also frees the top-level table.
 	__free_page_table_level((pgtbl_entry_t *)pt, 0);
-	kfree_page((void*)P2K(*pt));
 	*pt = NULL;
 }
 
+/*
+ * Share the user mappings of `src` with `dst`, which is empty, for `fork`.
+ * Rather than copying PTEs, the level-2 entries of `dst` point to the
+ * last-level tables of `src`. These entries are write-protected on both sides
+ * with APTable, so the first write into a 2 MiB range copies its table (see
+ * `unshare_pte_table`), and the written page is then copied on write.
+ * Huge pages are split first, since only tables can be shared. Their pages
+ * make up a huge page again once they are all freed (see `kfree_page`).
+ */
+void share_pgtbl(struct vmspace *src, struct vmspace *dst)
+{
+	pgtbl_entry_t *l0 = (pgtbl_entry_t *)P2K(src->pgtbl);
+	struct tlb_gather tlb;
+	tlb_gather_init(&tlb, src);
+
+	for (u64 i0 = 0; i0 < N_PTE_PER_TABLE; i0++) {
+		if (!(l0[i0] & PTE_VALID))
+			continue;
+		pgtbl_entry_t *l1 = (pgtbl_entry_t *)P2K(PTE_ADDRESS(l0[i0]));
+
+		for (u64 i1 = 0; i1 < N_PTE_PER_TABLE; i1++) {
+			if (!(l1[i1] & PTE_VALID))
+				continue;
+			pgtbl_entry_t *l2 =
+				(pgtbl_entry_t *)P2K(PTE_ADDRESS(l1[i1]));
+
+			for (u64 i2 = 0; i2 < N_PTE_PER_TABLE; i2++) {
+				if (!(l2[i2] & PTE_VALID))
+					continue;
+				u64 va = (i0 << 39) | (i1 << 30) | (i2 << 21);
+
+				if (is_huge_pde(l2[i2]))
+					split_huge_pde(&l2[i2], va);
+
+				// Write-protect the range in `src`. Its writable pages
+				// must be flushed from the TLB.
+				if (!(l2[i2] & PTE_TABLE_RO)) {
+					l2[i2] |= PTE_TABLE_RO;
+					tlb_gather_page(&tlb, va);
+					tlb_gather_page(&tlb, va + (1 << 21) -
+								      PAGE_SIZE);
+				}
+
+				// Point `dst` to the same table.
+				share_page((void *)P2K(PTE_ADDRESS(l2[i2])));
+				pgtbl_entry_t *pde = get_pde(dst->pgtbl, va, true);
+				*pde = l2[i2];
+			}
+		}
+	}
+	tlb_finish(&tlb);
+}
+
 void set_page_table(pgtbl_entry_t *pt)
 {
 	extern PTEntries invalid_pt;
@@ -97,50 +274,165 @@ void set_page_table(pgtbl_entry_t *pt)
 		arch_set_ttbr0(K2P(&invalid_pt));
 }
 
+/*
+ * Map `ka` at `va`. Invalid PTEs are never cached in the TLB, but if a valid
+ * mapping is replaced, the caller must flush `va` from the TLB.
+ */
 void map_in_pgtbl(pgtbl_entry_t *pt, u64 va, void *ka, u64 flags)
 {
 	pgtbl_entry_t *pte = get_pte(pt, va, true);
 
+	// Take the new reference first, in case `ka` is already mapped at `va`.
+	share_page(ka);
 	if (*pte & PTE_VALID)
-		unmap_in_pgtbl(pt, va);
+		detach_mapped_page(pte);
 
 	*pte = (pgtbl_entry_t)(K2P(ka) | flags | PTE_VALID);
+}
 
-	struct page *page_mapped = get_page_info_by_kaddr(ka);
-	if (page_mapped)
-		increment_rc(&page_mapped->ref);
-	arch_tlbi_vmalle1is();
+/*
+ * Map the huge page `ka` at `va`, which is aligned to HUGE_PAGE_SIZE, with a
+ * level-2 block entry. This fails if anything is mapped or has been mapped in
+ * the range, i.e. a last-level table is already there.
+ */
+bool map_huge_in_pgtbl(pgtbl_entry_t *pt, u64 va, void *ka, u64 flags)
+{
+	pgtbl_entry_t *pde = get_pde(pt, va, true);
+	if (*pde & PTE_VALID)
+		return false;
+
+	share_page(ka);
+	*pde = (pgtbl_entry_t)(K2P(ka) | flags | PTE_VALID);
+	return true;
 }
 
+/* Whether a huge page can be mapped at `va` by `map_huge_in_pgtbl`. */
+bool huge_range_free(pgtbl_entry_t *pt, u64 va)
+{
+	pgtbl_entry_t *pde = get_pde(pt, va, false);
+	return !pde || !(*pde & PTE_VALID);
+}
+
+/* Whether `va` lies in a huge page mapped in `pt`. */
+bool huge_mapped(pgtbl_entry_t *pt, u64 va)
+{
+	pgtbl_entry_t *pde = get_pde(pt, va, false);
+	return pde && is_huge_pde(*pde);
+}
+
+/* Unmap `va`. The caller must flush `va` from the TLB. */
 void unmap_in_pgtbl(pgtbl_entry_t *pt, u64 va)
 {
 	pgtbl_entry_t *pte = get_pte(pt, va, false);
-	if (!pte || !((u64)pte & PTE_VALID))
+	if ((!pte || !(*pte & PTE_VALID)) && !huge_mapped(pt, va))
 		return;
 
+	// Make the table private, or split the huge page, before changing it.
+	pte = get_pte(pt, va, true);
+
 	// The page is only detached, not freed.
 	detach_mapped_page(pte);
 
-	*pte &= !PTE_VALID;
-
-	arch_tlbi_vmalle1is();
+	*pte = 0;
 }
 
+/*
+ * Unmap [begin, end). Huge pages that are covered entirely are unmapped as a
+ * whole, while those covered in part are split. The caller must flush the range
+ * from the TLB.
+ */
 void unmap_range_in_pgtbl(pgtbl_entry_t *pt, u64 begin, u64 end)
 {
 	begin = PAGE_BASE(begin);
-	for (; begin < end; begin += PAGE_SIZE)
+	while (begin < end) {
+		pgtbl_entry_t *pde = get_pde(pt, begin, false);
+		if (pde && is_huge_pde(*pde) && begin % HUGE_PAGE_SIZE == 0 &&
+		    begin + HUGE_PAGE_SIZE <= end) {
+			put_huge_page((void *)P2K(PTE_ADDRESS(*pde)));
+			*pde = 0;
+			begin += HUGE_PAGE_SIZE;
+			continue;
+		}
 		unmap_in_pgtbl(pt, begin);
+		begin += PAGE_SIZE;
+	}
+}
+
+/* Flush the TLB entries of the page at `va` in `vs`. */
+void tlb_flush_page(struct vmspace *vs, u64 va)
+{
+	tlb_flush_range(vs, va, va + 1);
+}
+
+/*
+ * Flush the TLB entries of the pages in [begin, end) in `vs`. The entries of
+ * other address spaces are left alone. An address space without an ASID has
+ * never run, so it has no entries.
+ */
+void tlb_flush_range(struct vmspace *vs, u64 begin, u64 end)
+{
+	u64 asid = ASID(vs->asid);
+
+	begin = PAGE_BASE(begin);
+	if (begin >= end || vs->asid == 0)
+		return;
+
+	if ((end - begin) / PAGE_SIZE > TLB_FLUSH_MAX_PAGES) {
+		arch_tlbi_aside1is(asid);
+		return;
+	}
+
+	arch_tlbi_begin();
+	for (u64 va = begin; va < end; va += PAGE_SIZE)
+		arch_tlbi_vae1is(va, asid);
+	arch_tlbi_end();
 }
 
-/* Copy len bytes from p to user address va in page table. */
-int copy_to_user(pgtbl_entry_t *pt, void *va, void *p, usize len)
+void tlb_gather_init(struct tlb_gather *tlb, struct vmspace *vs)
+{
+	tlb->vs = vs;
+	tlb->start = (u64)-1;
+	tlb->end = 0;
+}
+
+/* Add the page at `va` to the range to be flushed. */
+void tlb_gather_page(struct tlb_gather *tlb, u64 va)
+{
+	tlb->start = MIN(tlb->start, PAGE_BASE(va));
+	tlb->end = MAX(tlb->end, PAGE_BASE(va) + PAGE_SIZE);
+}
+
+/* Flush the gathered range. `tlb` can be reused afterwards. */
+void tlb_finish(struct tlb_gather *tlb)
+{
+	if (tlb->start < tlb->end)
+		tlb_flush_range(tlb->vs, tlb->start, tlb->end);
+	tlb_gather_init(tlb, tlb->vs);
+}
+
+/*
+ * Copy len bytes from p to user address va in page table pt, which need not be
+ * the live one. The pages are written through the kernel mapping. See
+ * vm/uaccess.c for copies to the current process.
+ */
+int copy_to_pgtbl(pgtbl_entry_t *pt, void *va, void *p, usize len)
 {
 	while (len > 0) {
-		u64 p_addr = *get_pte(pt, (u64)va, true);
-		if (p_addr == NULL)
+		pgtbl_entry_t *pte = get_pte(pt, (u64)va, true);
+		if (pte == NULL)
 			return -1;
 
+		// Pages that are not present yet are demand-zero pages.
+		if (!(*pte & PTE_VALID)) {
+			void *page = kalloc_page();
+			if (page == NULL)
+				return -1;
+			memset(page, 0, PAGE_SIZE);
+			map_in_pgtbl(pt, PAGE_BASE((u64)va), page,
+				     PTE_USER_DATA);
+		}
+		u64 p_addr = *pte;
+
 		u64 offset = (u64)va - PAGE_BASE((u64)va);
 		u64 n = PAGE_SIZE - offset;
 		if (n > len)
@@ -189,7 +481,7 @@ void __print_page_table_level(pgtbl_entry_t *pt, u8 level)
 		       PTE_FLAGS(*p_pte) & PTE_RO,
 		       PTE_FLAGS(*p_pte) & PTE_USER_DATA);
 
-		if (level != 3)
+		if (level != 3 && !(level == 2 && is_huge_pde(*p_pte)))
 			__print_page_table_level(p_pte, level + 1);
 	}
 }
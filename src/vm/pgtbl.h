@@ -2,22 +2,58 @@
 
 #include <aarch64/mmu.h>
 #include <lib/list.h>
+#include <lib/rbtree.h>
 
 #define PT_FREEZE 1
 #define PT_UNFREEZE 1 << 1
 
+struct vmregion;
+
 struct vmspace {
 	pgtbl_entry_t *pgtbl;
+	u64 asid; // The ASID and its generation, or 0 if none (see vm/asid.c).
 	struct spinlock lock;
-	struct list vmregions;
+	struct rb_root_ vmregions; // Ordered by address (see vm/vmregion.c).
+	struct vmregion *heap;
+};
+
+/*
+ * Flushing more pages than this one by one costs more than refilling the
+ * whole TLB.
+ */
+#define TLB_FLUSH_MAX_PAGES 64
+
+/**
+ * tlb_gather - the range of user addresses whose PTEs have been changed.
+ *
+ * Changing a PTE that may be cached in a TLB is followed by
+ * `tlb_gather_page`, and the whole range is flushed at once by `tlb_finish`.
+ *
+ * @vs: the address space the PTEs belong to.
+ * @start: the first page in the range.
+ * @end: the end of the range. The range is empty if `start >= end`.
+ */
+struct tlb_gather {
+	struct vmspace *vs;
+	u64 start;
+	u64 end;
 };
 
 WARN_RESULT pgtbl_entry_t *get_pte(pgtbl_entry_t *pg, u64 va, bool alloc);
 void map_in_pgtbl(pgtbl_entry_t *pt, u64 va, void *ka, u64 flags);
+bool map_huge_in_pgtbl(pgtbl_entry_t *pt, u64 va, void *ka, u64 flags);
+bool huge_range_free(pgtbl_entry_t *pt, u64 va);
+bool huge_mapped(pgtbl_entry_t *pt, u64 va);
 void unmap_in_pgtbl(pgtbl_entry_t *pt, u64 va);
 void free_page_table(pgtbl_entry_t **pt);
 void set_page_table(pgtbl_entry_t *pt);
 void unmap_range_in_pgtbl(pgtbl_entry_t *pt, u64 begin, u64 end);
 void modify_pgtbl(pgtbl_entry_t *pt, int flag);
-int copy_to_user(pgtbl_entry_t *pd, void *va, void *p, usize len);
-void print_pgtbl(pgtbl_entry_t *pt);
\ No newline at end of file
+int copy_to_pgtbl(pgtbl_entry_t *pd, void *va, void *p, usize len);
+void print_pgtbl(pgtbl_entry_t *pt);
+void share_pgtbl(struct vmspace *src, struct vmspace *dst);
+void tlb_flush_page(struct vmspace *vs, u64 va);
+void tlb_flush_range(struct vmspace *vs, u64 begin, u64 end);
+void tlb_gather_init(struct tlb_gather *tlb, struct vmspace *vs);
+void tlb_gather_page(struct tlb_gather *tlb, u64 va);
+void tlb_finish(struct tlb_gather *tlb);
\ No newline at end of file
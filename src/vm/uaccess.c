@@ -0,0 +1,46 @@
+#include <lib/string.h>
+#include <vm/uaccess.h>
+
+/* See aarch64/usercopy.S. */
+extern usize __copy_user(void *dst, const void *src, usize n);
+
+/*
+ * Copy `n` bytes from `src` to the user address `dst` of the current process.
+ * The user pages are written directly, and those not present yet are faulted
+ * in. Returns -1 if any part of `dst` is not writable by the process.
+ */
+int copy_to_user(void *dst, const void *src, usize n)
+{
+	if (!access_ok(dst, n))
+		return -1;
+	return __copy_user(dst, src, n) ? -1 : 0;
+}
+
+/*
+ * Copy `n` bytes from the user address `src` of the current process to `dst`.
+ * Returns -1 if any part of `src` is not readable by the process.
+ */
+int copy_from_user(void *dst, const void *src, usize n)
+{
+	if (!access_ok(src, n))
+		return -1;
+	return __copy_user(dst, src, n) ? -1 : 0;
+}
+
+/* Copy to `dst`, which is either a user or a kernel address. */
+int copy_out(void *dst, const void *src, usize n)
+{
+	if (is_user_address(dst))
+		return copy_to_user(dst, src, n);
+	memcpy(dst, src, n);
+	return 0;
+}
+
+/* Copy from `src`, which is either a user or a kernel address. */
+int copy_in(void *dst, const void *src, usize n)
+{
+	if (is_user_address(src))
+		return copy_from_user(dst, src, n);
+	memcpy(dst, src, n);
+	return 0;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <lib/defines.h>
+
+/* User addresses are translated through TTBR0, which covers 48 bits. */
+#define USER_TOP (1ULL << 48)
+
+/* Whether `p` is a user address rather than a kernel one. */
+static inline bool is_user_address(const void *p)
+{
+	return (u64)p < USER_TOP;
+}
+
+/*
+ * Whether [addr, addr + size) lies within the user address space. It says
+ * nothing about whether the range is mapped; the user copies find that out
+ * when they touch it.
+ */
+static inline bool access_ok(const void *addr, usize size)
+{
+	return (u64)addr + size >= (u64)addr && (u64)addr + size <= USER_TOP;
+}
+
+WARN_RESULT int copy_to_user(void *dst, const void *src, usize n);
+WARN_RESULT int copy_from_user(void *dst, const void *src, usize n);
+WARN_RESULT int copy_out(void *dst, const void *src, usize n);
+WARN_RESULT int copy_in(void *dst, const void *src, usize n);
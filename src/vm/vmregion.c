@@ -10,20 +10,152 @@
 #include <lib/string.h>
 #include <proc/proc.h>
 #include <proc/sched.h>
+#include <vm/asid.h>
+#include <vm/mmap.h>
 #include <vm/pgtbl.h>
 #include <vm/vmregion.h>
 
+#define to_vmregion(node) container_of(node, struct vmregion, stnode)
+
+static bool __vmregion_cmp(rb_node lnode, rb_node rnode)
+{
+	return to_vmregion(lnode)->begin < to_vmregion(rnode)->begin;
+}
+
+/* Recompute the description of the subtree of `node` from its children. */
+static void __vmregion_augment(rb_node node)
+{
+	struct vmregion *vmr = to_vmregion(node);
+
+	vmr->subtree_begin = vmr->begin;
+	vmr->subtree_end = vmr->end;
+	vmr->subtree_gap = 0;
+
+	if (node->rb_left) {
+		struct vmregion *l = to_vmregion(node->rb_left);
+		vmr->subtree_begin = l->subtree_begin;
+		vmr->subtree_gap = MAX(l->subtree_gap, vmr->begin - l->subtree_end);
+	}
+	if (node->rb_right) {
+		struct vmregion *r = to_vmregion(node->rb_right);
+		vmr->subtree_end = r->subtree_end;
+		vmr->subtree_gap = MAX(vmr->subtree_gap,
+				       MAX(r->subtree_gap,
+					   r->subtree_begin - vmr->end));
+	}
+}
+
+/* Add `vmr`, which must not overlap any other region, to `vms`. */
+void insert_vmregion(struct vmspace *vms, struct vmregion *vmr)
+{
+	ASSERT(_rb_insert_augmented(&vmr->stnode, &vms->vmregions,
+				    __vmregion_cmp, __vmregion_augment) == 0);
+	if (vmr->flags & VMR_HEAP)
+		vms->heap = vmr;
+}
+
+/* Take `vmr` out of `vms`. The region itself is left to the caller. */
+void remove_vmregion(struct vmspace *vms, struct vmregion *vmr)
+{
+	_rb_erase_augmented(&vmr->stnode, &vms->vmregions, __vmregion_augment);
+	if (vms->heap == vmr)
+		vms->heap = NULL;
+}
+
+/*
+ * Move the bounds of `vmr` to [begin, end). It must not overlap any other
+ * region afterwards.
+ */
+void resize_vmregion(struct vmregion *vmr, u64 begin, u64 end)
+{
+	vmr->begin = begin;
+	vmr->end = end;
+	_rb_propagate(&vmr->stnode, __vmregion_augment);
+}
+
+/* Find the region of `vms` that contains `addr`, or NULL if there is none. */
+struct vmregion *vmregion_find(struct vmspace *vms, u64 addr)
+{
+	rb_node node = vms->vmregions.rb_node;
+
+	while (node) {
+		struct vmregion *vmr = to_vmregion(node);
+		if (addr < vmr->begin)
+			node = node->rb_left;
+		else if (addr >= vmr->end)
+			node = node->rb_right;
+		else
+			return vmr;
+	}
+	return NULL;
+}
+
+struct vmregion *vmregion_first(struct vmspace *vms)
+{
+	rb_node node = _rb_first(&vms->vmregions);
+	return node ? to_vmregion(node) : NULL;
+}
+
+struct vmregion *vmregion_next(struct vmregion *vmr)
+{
+	rb_node node = _rb_next(&vmr->stnode);
+	return node ? to_vmregion(node) : NULL;
+}
+
+/*
+ * Look for `len` free bytes at or above `*addr` in the subtree of `node`,
+ * visiting the regions in order. Everything below `*addr` has been looked at,
+ * and the range from `*addr` up to the subtree is free. On failure, `*addr` is
+ * moved past the subtree.
+ *
+ * Subtrees that start above `*addr` and have no gap large enough inside are
+ * skipped as a whole, so only O(log n) nodes are visited beyond the regions
+ * below `*addr`.
+ */
+static bool __find_gap(rb_node node, u64 *addr, u64 len)
+{
+	if (!node)
+		return false;
+
+	struct vmregion *vmr = to_vmregion(node);
+	if (vmr->subtree_end <= *addr)
+		return false;
+	if (vmr->subtree_begin >= *addr + len)
+		return true;
+	if (vmr->subtree_begin >= *addr && vmr->subtree_gap < len) {
+		*addr = vmr->subtree_end;
+		return false;
+	}
+
+	if (__find_gap(node->rb_left, addr, len))
+		return true;
+	if (vmr->begin >= *addr + len)
+		return true;
+	*addr = MAX(*addr, vmr->end);
+	return __find_gap(node->rb_right, addr, len);
+}
+
+/* Find the lowest address at or above `low` where `len` bytes are free. */
+u64 vmregion_find_gap(struct vmspace *vms, u64 low, u64 len)
+{
+	u64 addr = low;
+	__find_gap(vms->vmregions.rb_node, &addr, len);
+	return addr;
+}
+
 void copy_vmregions(struct vmspace *vms_source, struct vmspace *vms_dest)
 {
 	// Clear the vmregions of the dest vmspace.
 	free_vmregions(vms_dest);
 
 	// Copy the vmregions to the dest vmspace.
-	list_forall(p, vms_source->vmregions)
+	vmregion_forall(vms_source, vmr)
 	{
-		struct vmregion *vmr = container_of(p, struct vmregion, stnode);
-		create_vmregion(vms_dest, vmr->flags, vmr->begin,
-				vmr->end - vmr->begin);
+		struct vmregion *copy = create_vmregion(
+			vms_dest, vmr->flags, vmr->begin, vmr->end - vmr->begin);
+		copy->mmap_info = vmr->mmap_info;
+		if (copy->mmap_info.fp)
+			file_dup(copy->mmap_info.fp);
 	}
 }
 
@@ -31,6 +163,7 @@ void init_mmap_info(struct mmap_info *m)
 {
 	m->fp = NULL;
 	m->offset = 0;
+	m->filesz = 0;
 	m->prot = 0;
 	m->flags = 0;
 }
@@ -39,8 +172,10 @@ void init_vmspace(struct vmspace *vms)
 {
 	vms->pgtbl = (pgtbl_entry_t *)K2P(kalloc_page());
 	memset((void *)P2K(vms->pgtbl), 0, PAGE_SIZE);
+	vms->asid = 0;
 	init_spinlock(&vms->lock);
-	list_init(&vms->vmregions);
+	vms->vmregions.rb_node = NULL;
+	vms->heap = NULL;
 }
 
 void copy_vmspace(struct vmspace *vms_source, struct vmspace *vms_dest,
@@ -51,25 +186,35 @@ void copy_vmspace(struct vmspace *vms_source, struct vmspace *vms_dest,
 	free_page_table(&(vms_dest->pgtbl));
 
 	vms_dest->pgtbl = (pgtbl_entry_t *)K2P(kalloc_page());
+	memset((void *)P2K(vms_dest->pgtbl), 0, PAGE_SIZE);
+
+	// Share the last-level page tables. Nothing is copied until one side
+	// writes.
+	if (share) {
+		share_pgtbl(vms_source, vms_dest);
+		return;
+	}
 
 	// Get the pte according to the vmregions.
-	list_forall(p, vms_source->vmregions)
+	vmregion_forall(vms_source, vmr)
 	{
-		struct vmregion *vmr = container_of(p, struct vmregion, stnode);
 		for (u64 i = PAGE_BASE(vmr->begin); i < vmr->end;
 		     i += PAGE_SIZE) {
 			pgtbl_entry_t *pte_ptr =
 				get_pte(vms_source->pgtbl, i, false);
+			// A huge page is split to be copied page by page.
+			if (pte_ptr == NULL && huge_mapped(vms_source->pgtbl, i))
+				pte_ptr = get_pte(vms_source->pgtbl, i, true);
 			if (pte_ptr == NULL || !(*pte_ptr & PTE_VALID))
 				continue;
 
-			if (share) {
+			// The pages of a shared file mapping are shared as they are,
+			// along with their dirty bits (see `mmap_sync`).
+			if ((vmr->flags & VMR_MM) &&
+			    (vmr->mmap_info.flags & MAP_SHARED)) {
 				map_in_pgtbl(vms_dest->pgtbl, i,
 					     (void *)P2K(PTE_ADDRESS(*pte_ptr)),
-					     PTE_FLAGS(*pte_ptr) | PTE_RO);
-				map_in_pgtbl(vms_source->pgtbl, i,
-					     (void *)P2K(PTE_ADDRESS(*pte_ptr)),
-					     (PTE_FLAGS(*pte_ptr) | PTE_RO));
+					     PTE_FLAGS(*pte_ptr));
 			} else {
 				// Allocate a new page and map it in the new page table.
 				void *ka = kalloc_page();
@@ -82,22 +227,56 @@ void copy_vmspace(struct vmspace *vms_source, struct vmspace *vms_dest,
 	}
 }
 
+/* Release everything in `vms`. The memory of `vms` itself belongs to the
+ * caller. */
 void destroy_vmspace(struct vmspace *vms)
 {
 	free_vmregions(vms);
 	free_page_table(&(vms->pgtbl));
-	kfree((void *)vms);
+	asid_free(vms);
 }
 
+/* Whether [begin, end) overlaps any region of `vms`. */
 bool check_vmregion_intersection(struct vmspace *vms, u64 begin, u64 end)
 {
-	list_forall(p, vms->vmregions)
-	{
-		struct vmregion *vmr = container_of(p, struct vmregion, stnode);
-		if ((begin >= vmr->begin && begin < vmr->end) ||
-		    (end >= vmr->begin && end < vmr->end))
+	rb_node node = vms->vmregions.rb_node;
+
+	// Look for the first region that ends above `begin`.
+	while (node) {
+		struct vmregion *vmr = to_vmregion(node);
+		if (vmr->end <= begin) {
+			node = node->rb_right;
+		} else if (vmr->begin < end) {
 			return true;
+		} else {
+			node = node->rb_left;
+		}
+	}
+	return false;
+}
+
+/*
+ * Whether a region of `vms` that overlaps [begin, end) is backed by a file. A
+ * fault there may take the lock of the inode and read from the disk.
+ */
+bool check_vmregion_file_backed(struct vmspace *vms, u64 begin, u64 end)
+{
+	rb_node node = vms->vmregions.rb_node;
+	struct vmregion *first = NULL;
+
+	// Look for the first region that ends above `begin`.
+	while (node) {
+		struct vmregion *vmr = to_vmregion(node);
+		if (vmr->end <= begin) {
+			node = node->rb_right;
+		} else {
+			first = vmr;
+			node = node->rb_left;
+		}
 	}
+	for (struct vmregion *v = first; v && v->begin < end; v = vmregion_next(v))
+		if (v->mmap_info.fp)
+			return true;
 	return false;
 }
 
@@ -110,74 +289,65 @@ struct vmregion *create_vmregion(struct vmspace *vms, u64 flags, u64 begin,
 	struct vmregion *vmr =
 		(struct vmregion *)kalloc(sizeof(struct vmregion));
 	memset(vmr, 0, sizeof(struct vmregion));
-	init_list_node(&vmr->stnode);
 	vmr->flags = flags;
 	vmr->begin = begin;
 	vmr->end = begin + len;
 	init_mmap_info(&vmr->mmap_info);
-	list_push_back(&vms->vmregions, &vmr->stnode);
+	insert_vmregion(vms, vmr);
 	return vmr;
 }
 
 void free_vmregions(struct vmspace *vms)
 {
-	list_lock(&vms->vmregions);
-	while (vms->vmregions.size) {
-		struct vmregion *vmr = container_of(vms->vmregions.head,
-						    struct vmregion, stnode);
+	struct vmregion *vmr;
+
+	while ((vmr = vmregion_first(vms))) {
+		remove_vmregion(vms, vmr);
+
+		// No TLB flush is needed. The page table is no longer in use, and
+		// its TLB entries are flushed along with its ASID.
 		unmap_range_in_pgtbl(vms->pgtbl, vmr->begin, vmr->end);
-		list_remove(&vms->vmregions, &vmr->stnode);
+
+		// Closing the backing file may sleep, so no lock is held here.
+		if (vmr->mmap_info.fp)
+			file_close(vmr->mmap_info.fp);
 		kfree(vmr);
 	}
-	list_unlock(&vms->vmregions);
 }
 
 u64 sbrk(i64 size)
 {
 	ASSERT(size % PAGE_SIZE == 0);
-	u64 old_end = 0;
-	u64 new_end = 0;
-	list_forall(p, thisproc()->vmspace.vmregions)
-	{
-		struct vmregion *v = container_of(p, struct vmregion, stnode);
-		if (v->flags & VMR_HEAP) {
-			// Save the old end address of the vmregion.
-			old_end = v->end;
-
-			// Set the new end address of the vmregion.
-			v->end += size;
-			new_end = v->end;
-
-			// If the heap size shrinks, we need to first check if the new end
-			// is above the address where the heap section begins. Then we free
-			// the pages that are not used by heap after the change of heap
-			// size.
-			if (new_end < old_end) {
-				if (new_end < v->begin) {
-					printk("[Error] Invalid size.\n");
-					return -1;
-				}
-				unmap_range_in_pgtbl(thisproc()->vmspace.pgtbl,
-						     new_end, old_end);
-			}
+	struct vmspace *vs = &thisproc()->vmspace;
+	struct vmregion *v = vs->heap;
 
-			goto heap_found;
-		}
+	// Heap section not found.
+	if (v == NULL) {
+		printk("[Error] Heap section not found.\n");
+		return -1;
 	}
 
-	// Heap section not found.
-	printk("[Error] Heap section not found.\n");
-	return -1;
+	u64 old_end = v->end;
+	u64 new_end = v->end + size;
 
-heap_found:
-	list_forall(p, thisproc()->vmspace.vmregions)
-	{
-		struct vmregion *v = container_of(p, struct vmregion, stnode);
-		if ((v->begin < new_end) && (new_end < v->end)) {
-			printk("[Error] Invalid size.\n");
-			return -1;
-		}
+	// The heap can neither shrink below where it begins nor grow into the
+	// next region.
+	if (new_end < v->begin ||
+	    (new_end > old_end &&
+	     check_vmregion_intersection(vs, old_end, new_end))) {
+		printk("[Error] Invalid size.\n");
+		return -1;
+	}
+
+	resize_vmregion(v, v->begin, new_end);
+
+	// If the heap size shrinks, we free the pages that are not used by heap
+	// after the change of heap size.
+	if (new_end < old_end) {
+		unmap_range_in_pgtbl(vs->pgtbl, new_end, old_end);
+		tlb_flush_range(vs, new_end, old_end);
 	}
+
 	return old_end;
 }
 
@@ -187,29 +357,16 @@ heap_found:
  */
 bool user_readable(const void *start, usize size)
 {
-	struct list vmregions = thisproc()->vmspace.vmregions;
-	list_forall(p, vmregions)
-	{
-		struct vmregion *v = container_of(p, struct vmregion, stnode);
-		if (v->begin <= (u64)start && ((u64)start) + size <= v->end)
-			return true;
-	}
-	return false;
+	struct vmregion *v = vmregion_find(&thisproc()->vmspace, (u64)start);
+	return v && ((u64)start) + size <= v->end;
 }
 
 /* Check if the virtual address [start,start+size) is READABLE & WRITEABLE by
  * the current user process. */
 bool user_writeable(const void *start, usize size)
 {
-	struct list vmregions = thisproc()->vmspace.vmregions;
-	list_forall(p, vmregions)
-	{
-		struct vmregion *v = container_of(p, struct vmregion, stnode);
-		if (!(v->flags & VMR_RO) && v->begin <= (u64)start &&
-		    ((u64)start) + size <= v->end)
-			return true;
-	}
-	return false;
+	struct vmregion *v = vmregion_find(&thisproc()->vmspace, (u64)start);
+	return v && !(v->flags & VMR_RO) && ((u64)start) + size <= v->end;
 }
 
 /* Get the length of a string including tailing '\0' in the memory space of
@@ -14,28 +14,58 @@
 #define VMR_MM (1 << 5)
 
 struct mmap_info {
-	struct file *fp;
-	u64 offset;
+	struct file *fp; // The backing file, or NULL if the region is anonymous.
+	u64 offset; // The file offset mapped at the beginning of the region.
+	u64 filesz; // Bytes backed by the file. The rest of the region is zero.
 	int prot;
 	int flags;
 };
 
+/**
+ * vmregion - a range of user addresses in a vmspace.
+ *
+ * The regions of a vmspace never overlap, and they are kept in an rbtree
+ * ordered by address. Each node also describes its subtree, so that both the
+ * region at an address and a free range of a given length are found in
+ * O(log n).
+ *
+ * @stnode: link this region into `vmspace.vmregions`.
+ * @subtree_begin: the beginning of the first region in the subtree.
+ * @subtree_end: the end of the last region in the subtree.
+ * @subtree_gap: the largest gap between two regions in the subtree.
+ */
 struct vmregion {
 	u64 flags;
 	u64 begin;
 	u64 end;
-	struct list_node stnode;
+	struct rb_node_ stnode;
+	u64 subtree_begin;
+	u64 subtree_end;
+	u64 subtree_gap;
 	struct mmap_info mmap_info;
 };
 
+/* Iterate over the regions of `vms` in order of address. */
+#define vmregion_forall(vms, v)                                     \
+	for (struct vmregion *v = vmregion_first(vms); v;           \
+	     v = vmregion_next(v))
+
 void init_vmspace(struct vmspace *vms);
 void copy_vmregions(struct vmspace *vms_source, struct vmspace *vms_dest);
 void copy_vmspace(struct vmspace *vms_source, struct vmspace *vms_dest,
 		  bool share);
 void destroy_vmspace(struct vmspace *vms);
 bool check_vmregion_intersection(struct vmspace *vms, u64 begin, u64 end);
+bool check_vmregion_file_backed(struct vmspace *vms, u64 begin, u64 end);
 struct vmregion *create_vmregion(struct vmspace *vms, u64 flags, u64 begin,
 				 u64 len);
+void insert_vmregion(struct vmspace *vms, struct vmregion *vmr);
+void remove_vmregion(struct vmspace *vms, struct vmregion *vmr);
+void resize_vmregion(struct vmregion *vmr, u64 begin, u64 end);
+struct vmregion *vmregion_find(struct vmspace *vms, u64 addr);
+struct vmregion *vmregion_first(struct vmspace *vms);
+struct vmregion *vmregion_next(struct vmregion *vmr);
+u64 vmregion_find_gap(struct vmspace *vms, u64 low, u64 len);
 void free_vmregions(struct vmspace *pd);
 u64 sbrk(i64 size);
 bool user_readable(const void *start, usize size);